@@ -52,24 +52,29 @@
  * 	11110xxx        8
  * 	10xxxxxx	64
  *
- * These arrays are automatically generated, using simple increments.
+ * These arrays are automatically generated, using simple increments. They
+ * are carved out of a static table, since the grammar (and thus the tokens
+ * that refer to them) lives for as long as the process does.
  */
+static char jsp_utf8_tab[128 + 32 + 16 + 8 + 64];
+static size_t jsp_utf8_tab_used;
+
 static void
 jsp_utf8_byte_tok(lp_grmr_t *g, char *nm, uint8_t byte_min, uint8_t byte_max)
 {
-	uint8_t num_elems = byte_max - byte_min;
-	char *data = malloc(num_elems);
-	int i = 0;
-	uint8_t c = byte_min;
+	char *data = jsp_utf8_tab + jsp_utf8_tab_used;
+	int num_elems = 0;
+	int c = byte_min;
 	while (c <= byte_max) {
 		if (c != '\t' && c != '\\' && c != '\"' &&
 		    c != '\n' && c != '\b' && c != '\f' &&
 		    c != '\r') {
-			data[i] = c;
-			i++;
+			data[num_elems] = c;
+			num_elems++;
 		}
 		c++;
 	}
+	jsp_utf8_tab_used += num_elems;
 	lp_tok_t *byte = lp_create_tok(g, nm);
 	lp_add_tok_op(byte, ROP_ANYOF, 8, num_elems, data);
 	return;
@@ -646,76 +651,118 @@ jsp_make_grammar()
 }
 
 static lp_grmr_t *grammar;
-static int init = 0;
+static pthread_once_t grammar_once = PTHREAD_ONCE_INIT;
+
+static void
+jsp_grammar_init()
+{
+	grammar = jsp_make_grammar();
+}
 
+/*
+ * Parses `in` and returns its AST, or NULL (with errno set) on failure. If
+ * `d` is not NULL, the keys of every object member are interned into it, and
+ * member lookups on the resulting AST compare key-ids instead of bytes. The
+ * same dictionary can be (and is meant to be) shared by many parses.
+ *
+ * If `budget` is not 0, it is a hard limit on the memory that the AST may use
+ * (including any later edits to it, and any keys it adds to `d`, which stay
+ * charged to it even though they outlive it). A parse that would exceed it is
+ * abandoned as soon as it does, and fails with ENOMEM. Input that isn't
+ * well-formed JSON fails with EINVAL.
+ *
+ * Only the value index is built. Walking, and everything else, works off of
+ * it, and never looks at a libparse tree; see jsp_parse_tree() if you want
+ * one anyway.
+ *
+ * The input is not copied, and must outlive the AST.
+ */
 jsp_ast_t *
-jsp_parse(char *in, size_t sz)
+jsp_parse_budget(char *in, size_t sz, jsp_keydict_t *d, size_t budget)
+{
+	return (jsp_parse_fill(in, sz, d, budget, NULL, NULL));
+}
+
+/*
+ * Like jsp_parse_budget(), but if `fill` isn't NULL, none of `in` is present
+ * yet, and the parse calls `fill` to wait for it as it goes.
+ */
+jsp_ast_t *
+jsp_parse_fill(char *in, size_t sz, jsp_keydict_t *d, size_t budget,
+    jsp_fill_t fill, void *arg)
 {
-	if (!init) {
-		grammar = jsp_make_grammar();
-		init = 1;
-	}
 	if (in == NULL || sz == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	jsp_ast_t *jast = jsp_ast_alloc(budget);
+	if (jast == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	jast->jspa_in = in;
+	jast->jspa_sz = sz;
+	jast->jspa_dict = d;
+	errno = 0;
+	if ((fill == NULL ? jsp_index_build(jast) :
+	    jsp_index_build_fill(jast, 0, fill, arg)) != 0) {
+		if (errno != ENOMEM) {
+			errno = EINVAL;
+		}
+		jsp_destroy(jast);
 		return (NULL);
 	}
-	sz *= 8; /* transform size to bits */
+	return (jast);
+}
+
+/*
+ * Like jsp_parse(), but also runs the libparse grammar over the input, and
+ * keeps the resulting tree (one node per byte, roughly) with the AST. Nothing
+ * in this library reads that tree; it is only useful for working on the
+ * grammar itself, and costs far more than the parse.
+ */
+jsp_ast_t *
+jsp_parse_tree(char *in, size_t sz)
+{
+	jsp_ast_t *jast = jsp_parse(in, sz);
+	if (jast == NULL) {
+		return (NULL);
+	}
+	(void) pthread_once(&grammar_once, jsp_grammar_init);
 	lp_ast_t *ast = lp_create_ast();
-	jsp_ast_t *jast = malloc(sizeof (jsp_ast_t));
 	jast->jspa_tree = ast;
 	lp_dump_grmr(grammar);
-	lp_run_grammar(grammar, ast, in, sz);
-	lp_map_cc(ast, "key:val", "kvp", "string", "value");
-	lp_map_pd(ast, "obj:key", "object", "key");
+	lp_run_grammar(grammar, ast, in, sz * 8); /* size in bits */
 	lp_finish_run(ast);
 	return (jast);
 }
 
-void
-jsp_map_query_key_cb(lp_ast_node_t *v, void *arg)
+jsp_ast_t *
+jsp_parse_dict(char *in, size_t sz, jsp_keydict_t *d)
 {
-	jsp_walk_t *w = arg;
-	/*
-	 * We can have more than 1 value mapped to a key (because JSON is
-	 * 'flexible'). For now we just match the first one, and ignore any
-	 * subsequent ones.
-	 */
-	if (w->jspw_cur_val == NULL) {
-		/*
-		 * We now store the value ast-node in the walked. However the
-		 * value is merely a splitter that pointer an object, array, or
-		 * one of the primitive types. We use the splitter
-		 * dereferencing functionality to get the child.
-		 */
-		w->jspw_cur_val = lp_deref_splitter(v);
-	}
+	return (jsp_parse_budget(in, sz, d, 0));
 }
 
+jsp_ast_t *
+jsp_parse(char *in, size_t sz)
+{
+	return (jsp_parse_budget(in, sz, NULL, 0));
+}
 
 void
-jsp_map_query_obj_cb(lp_ast_node_t *k, void *arg)
+jsp_destroy(jsp_ast_t *a)
 {
-	/*
-	 * `k` is the value that corresponds to an object's key.
-	 */
-	jsp_walk_t *w = arg;
-	/*
-	 * We can have more than 1 matcihng key mapped to an object (because
-	 * JSON is 'flexible'). For now we just match the first one, and ignore
-	 * any subsequent ones.
-	 */
-	if (w->jspw_cur_key == NULL) {
-		int c = lp_cmp_contents(w->jspw_key, w->jspw_key_sz*8, k);
-		if (c == 0) {
-			w->jspw_cur_key = k;
-			/*
-			 * TODO from here we should do a query against the
-			 * key:val mapping. Once we get the val, we want to
-			 * deref the splitter and store that object in some
-			 * member or something.
-			 */
-			lp_ast_t *ast = w->jspw_tree->jspa_tree;
-			lp_map_query(ast, "key:val", k, jsp_map_query_key_cb, arg);
-		}
+	if (a->jspa_tree != NULL) {
+		lp_destroy_ast(a->jspa_tree);
+	}
+	jsp_file_release(a);
+	jsp_chunks_free(a);
+	free(a->jspa_ebuf);
+	free(a->jspa_jnl);
+	if (a->jspa_arena != NULL) {
+		jsp_arena_rele(a->jspa_arena);
+	} else {
+		jsp_ast_free(a);
 	}
 }
 
@@ -723,25 +770,200 @@ jsp_map_query_obj_cb(lp_ast_node_t *k, void *arg)
  * This function will try to get to the object that's referred to by `key`. If
  * it finds a key with this value, it will return 0. Otherwise, -1. To get to a
  * deeply nested key, you must start from the root and work your down, much how
- * you would walk a chain of nested objects (foo.bar.baz).
+ * you would walk a chain of nested objects (foo.bar.baz). A fresh (or reset)
+ * walker starts at the root, and each successful call moves the walker to the
+ * value of the member it found.
  *
- * Once the key is found `w` will contain a reference to this key's value, as
- * well as its exact starting and ending location within the input provided to
- * the parse function above.
+ * We can have more than 1 value mapped to a key (because JSON is 'flexible').
+ * For now we just match the first one, and ignore any subsequent ones.
+ *
+ * If the AST was parsed against a key dictionary, we look `key` up once, and
+ * then compare ids. A key that isn't in the dictionary can't be in the
+ * document either.
  */
 int
 jsp_walk_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t sz)
 {
-	lp_ast_t *ast = a->jspa_tree;
-	lp_ast_node_t *root = lp_get_root_node(ast);
-	lp_ast_node_t *obj = root;
-	w->jspw_par_obj = obj;
-	w->jspw_key = key;
-	w->jspw_key_sz = sz;
-	void *arg = w;
-	lp_map_query(ast, "obj:key", obj, jsp_map_query_obj_cb, arg);
-	if (w->jspw_cur_val == NULL) {
+	uint32_t kid = JSP_NOKEY;
+	uint32_t cur = jsp_walk_cur(a, w);
+	if (cur == JSP_NONE) {
+		return (-1);
+	}
+	jsp_node_t *obj = JSP_NODE(a, cur);
+	if (obj->jspn_type != OBJECT) {
+		return (-1);
+	}
+	if (a->jspa_dict != NULL &&
+	    jsp_keydict_lookup(a->jspa_dict, key, sz, &kid) != 0) {
+		return (-1);
+	}
+	uint32_t c = obj->jspn_child;
+	while (c != JSP_NONE) {
+		jsp_node_t *n = JSP_NODE(a, c);
+		if (kid != JSP_NOKEY) {
+			if (n->jspn_kid == kid) {
+				break;
+			}
+		} else if (n->jspn_klen == sz &&
+		    memcmp(JSP_KEY(a, c), key, sz) == 0) {
+			break;
+		}
+		c = n->jspn_next;
+	}
+	if (c == JSP_NONE) {
+		return (-1);
+	}
+	w->jspw_cur = c;
+	return (0);
+}
+
+/*
+ * Moves the walker back to the root of whatever AST it was walking.
+ */
+void
+jsp_walk_reset(jsp_walk_t *w)
+{
+	w->jspw_cur = JSP_NONE;
+}
+
+/*
+ * Returns the type of the value that `w` is on, or NUL if the walker is
+ * stale.
+ */
+jsp_type_t
+jsp_value_type(jsp_ast_t *a, jsp_walk_t *w)
+{
+	uint32_t cur = jsp_walk_cur(a, w);
+	if (cur == JSP_NONE) {
+		return (NUL);
+	}
+	return (JSP_NODE(a, cur)->jspn_type);
+}
+
+/*
+ * Returns the number of bytes that jsp_value_str() will copy out of the value
+ * that `w` is on, not counting the terminating NUL. That is 0 if the value is
+ * an object or array, or if the walker is stale.
+ */
+size_t
+jsp_value_size(jsp_ast_t *a, jsp_walk_t *w)
+{
+	uint32_t cur = jsp_walk_cur(a, w);
+	if (cur == JSP_NONE) {
+		return (0);
+	}
+	jsp_node_t *n = JSP_NODE(a, cur);
+	switch (n->jspn_type) {
+	case OBJECT:
+	case ARRAY:
+		return (0);
+	case STRING:
+		return (n->jspn_len - 2);
+	default:
+		return (n->jspn_len);
+	}
+}
+
+/*
+ * Copies the text of the scalar value that `w` is on into `out`, which must
+ * have room for jsp_value_size() bytes plus a NUL. Like keys, strings are
+ * copied raw: the bytes between the quotes, with any escapes left as they
+ * are. Other scalars are copied as they appear in the input.
+ */
+int
+jsp_value_str(jsp_ast_t *a, jsp_walk_t *w, char *out)
+{
+	uint32_t cur = jsp_walk_cur(a, w);
+	if (cur == JSP_NONE) {
+		return (-1);
+	}
+	jsp_node_t *n = JSP_NODE(a, cur);
+	char *v = JSP_VAL(a, cur);
+	size_t sz = n->jspn_len;
+	switch (n->jspn_type) {
+	case OBJECT:
+	case ARRAY:
 		return (-1);
+	case STRING:
+		v++;
+		sz -= 2;
+		break;
+	default:
+		break;
+	}
+	bcopy(v, out, sz);
+	out[sz] = '\0';
+	return (0);
+}
+
+/*
+ * Number literals aren't NUL-terminated in the input, so the conversions
+ * below work on a copy. Most of them fit on the stack.
+ */
+#define	JSP_NUM_STACK	64
+
+static char *
+jsp_value_num(jsp_ast_t *a, uint32_t idx, char *buf)
+{
+	size_t sz = JSP_NODE(a, idx)->jspn_len;
+	char *s = buf;
+	if (sz >= JSP_NUM_STACK && (s = malloc(sz + 1)) == NULL) {
+		return (NULL);
+	}
+	bcopy(JSP_VAL(a, idx), s, sz);
+	s[sz] = '\0';
+	return (s);
+}
+
+/*
+ * Stores the integer that `w` is on in `out`. Negative integers are stored in
+ * two's complement. Fails if the value isn't an integer, or (with errno set
+ * to ERANGE) if it doesn't fit in 64 bits.
+ */
+int
+jsp_value_int(jsp_ast_t *a, jsp_walk_t *w, uint64_t *out)
+{
+	char buf[JSP_NUM_STACK];
+	uint32_t cur = jsp_walk_cur(a, w);
+	if (cur == JSP_NONE || JSP_NODE(a, cur)->jspn_type != INTEGER) {
+		return (-1);
+	}
+	char *s = jsp_value_num(a, cur, buf);
+	if (s == NULL) {
+		return (-1);
+	}
+	errno = 0;
+	if (s[0] == '-') {
+		*out = (uint64_t)strtoll(s, NULL, 10);
+	} else {
+		*out = strtoull(s, NULL, 10);
+	}
+	if (s != buf) {
+		free(s);
+	}
+	return (errno == 0 ? 0 : -1);
+}
+
+/*
+ * Stores the number that `w` is on, integer or not, in `out`. Numbers too big
+ * for a double come out as infinity.
+ */
+int
+jsp_value_float(jsp_ast_t *a, jsp_walk_t *w, double *out)
+{
+	char buf[JSP_NUM_STACK];
+	uint32_t cur = jsp_walk_cur(a, w);
+	if (cur == JSP_NONE || (JSP_NODE(a, cur)->jspn_type != INTEGER &&
+	    JSP_NODE(a, cur)->jspn_type != FLOAT)) {
+		return (-1);
+	}
+	char *s = jsp_value_num(a, cur, buf);
+	if (s == NULL) {
+		return (-1);
+	}
+	*out = strtod(s, NULL);
+	if (s != buf) {
+		free(s);
 	}
 	return (0);
 }
@@ -749,11 +971,11 @@ jsp_walk_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t sz)
 jsp_walk_t *
 jsp_create_walker()
 {
-	return (calloc(1, sizeof (jsp_walk_t)));
+	return (jsp_walk_alloc());
 }
 
 void
 jsp_destroy_walker(jsp_walk_t *w)
 {
-	free(w);
+	jsp_walk_free(w);
 }
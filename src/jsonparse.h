@@ -17,13 +17,83 @@ typedef enum jsp_type {
 	BOOL
 } jsp_type_t;
 
+/*
+ * The ways in which jsp_validate() can find its input to be malformed.
+ */
+typedef enum jsp_errclass {
+	JSP_ERR_NONE,
+	JSP_ERR_EOF,		/* input ended in the middle of a value */
+	JSP_ERR_SYNTAX,		/* unexpected character */
+	JSP_ERR_STRING,		/* bad escape, or control character */
+	JSP_ERR_UTF8,		/* ill-formed UTF-8 in a string */
+	JSP_ERR_NUMBER,		/* malformed number */
+	JSP_ERR_DEPTH,		/* nested too deeply */
+	JSP_ERR_TRAILING	/* more input after the value */
+} jsp_errclass_t;
+
+/*
+ * Where the input first went wrong. The offset is in bytes, and lines and
+ * columns count from 1 (columns in bytes, too).
+ */
+typedef struct jsp_err {
+	jsp_errclass_t	jspe_class;
+	size_t		jspe_off;
+	size_t		jspe_line;
+	size_t		jspe_col;
+} jsp_err_t;
+
+/*
+ * Flags for jsp_parse_file(). JSP_FILE_URING reads the file into the heap
+ * through io_uring (Linux 5.6 and up) instead of mapping it, and parses each
+ * part of it as soon as it has been read. That costs an extra copy; it only
+ * pays off for files that aren't already cached, or can't be mapped
+ * efficiently. Where io_uring isn't available, the file is mapped anyway.
+ */
+#define	JSP_FILE_URING	0x1
+
 typedef struct jsp_ast jsp_ast_t;
 typedef struct jsp_walk jsp_walk_t;
+typedef struct jsp_keydict jsp_keydict_t;
 jsp_ast_t *jsp_parse(char *in, size_t sz);
-/* TODO not implemented */
+jsp_ast_t *jsp_parse_dict(char *in, size_t sz, jsp_keydict_t *d);
+jsp_ast_t *jsp_parse_tree(char *in, size_t sz);
+jsp_ast_t *jsp_parse_budget(char *in, size_t sz, jsp_keydict_t *d,
+    size_t budget);
+jsp_ast_t *jsp_parse_file(char *path, int flags);
+size_t jsp_parse_batch(char **bufs, size_t *lens, size_t n, jsp_ast_t **out);
+size_t jsp_parse_batch_mt(char **bufs, size_t *lens, size_t n, jsp_ast_t **out,
+    uint32_t nthr);
+void jsp_destroy(jsp_ast_t *);
+int jsp_validate(char *in, size_t sz, jsp_err_t *err);
+int jsp_reparse(jsp_ast_t *a, char *new_in, size_t new_sz, size_t edit_off,
+    size_t old_len, size_t new_len);
+jsp_keydict_t *jsp_keydict_create();
+void jsp_keydict_destroy(jsp_keydict_t *);
+int jsp_keydict_intern(jsp_keydict_t *, char *key, size_t sz, uint32_t *id);
+int jsp_keydict_lookup(jsp_keydict_t *, char *key, size_t sz, uint32_t *id);
+char *jsp_keydict_key(jsp_keydict_t *, uint32_t id, size_t *sz);
+size_t jsp_keydict_count(jsp_keydict_t *);
+/*
+ * A walker goes stale when the value it is on is deleted or replaced (by an
+ * edit, a patch, or a re-parse). Every call fails on a stale walker until it
+ * is reset with jsp_walk_reset().
+ */
 jsp_walk_t *jsp_create_walker();
 void jsp_destroy_walker(jsp_walk_t *);
 int jsp_walk_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t sz);
+void jsp_walk_reset(jsp_walk_t *);
+int jsp_set_value(jsp_ast_t *a, jsp_walk_t *w, char *json, size_t sz);
+int jsp_insert_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t ksz,
+    char *json, size_t sz);
+int jsp_delete_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t ksz);
+int jsp_append_value(jsp_ast_t *a, jsp_walk_t *w, char *json, size_t sz);
+int jsp_apply_patch(jsp_ast_t *a, char *patch, size_t sz);
+size_t jsp_serialize(jsp_ast_t *a, char *out, size_t sz);
+size_t jsp_minify(char *in, size_t sz, char *out);
+size_t jsp_canonicalize(jsp_ast_t *a, char *out, size_t sz);
+uint64_t jsp_value_hash(jsp_ast_t *a, jsp_walk_t *w);
+int jsp_value_equal(jsp_ast_t *a1, jsp_walk_t *w1, jsp_ast_t *a2,
+    jsp_walk_t *w2);
 size_t jsp_value_size(jsp_ast_t *a, jsp_walk_t *w);
 jsp_type_t jsp_value_type(jsp_ast_t *a, jsp_walk_t *w);
 int jsp_value_str(jsp_ast_t *a, jsp_walk_t *w, char *);
@@ -0,0 +1,146 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include "jsonparse_impl.h"
+
+/*
+ * Batch Parsing
+ * =============
+ *
+ * jsp_parse_batch() parses `n` documents, and stores the resulting ASTs in
+ * `out`. It is meant for large numbers of small documents, like the messages
+ * that come off of a bus, where the fixed cost of jsp_parse() (taking an AST
+ * wrapper and a whole chunk of nodes from the caches) would dwarf the cost of
+ * the parse itself.
+ *
+ * So all of the ASTs in a batch are parsed into a shared arena (see
+ * jsonparse_umem.c). Each AST is still destroyed individually, with
+ * jsp_destroy(), and may be walked and edited like any other.
+ *
+ * A document that isn't well-formed gets a NULL entry in `out`. We return
+ * the number of documents that were parsed.
+ *
+ * jsp_parse_batch_mt() splits the batch into `nthr` contiguous ranges, and
+ * parses each range on its own thread, into its own arena. The calling
+ * thread takes the first range. If a thread can't be created, the caller
+ * parses its range too.
+ */
+
+typedef struct jsp_batch {
+	char		**jspt_bufs;
+	size_t		*jspt_lens;
+	jsp_ast_t	**jspt_out;
+	size_t		jspt_start;
+	size_t		jspt_end;
+	size_t		jspt_nparsed;
+	pthread_t	jspt_tid;
+	int		jspt_started;
+} jsp_batch_t;
+
+static void *
+jsp_batch_range(void *arg)
+{
+	jsp_batch_t *b = arg;
+	size_t i = b->jspt_start;
+	while (i < b->jspt_end) {
+		b->jspt_out[i] = NULL;
+		i++;
+	}
+	b->jspt_nparsed = 0;
+	jsp_arena_t *ar = jsp_arena_create();
+	if (ar == NULL) {
+		return (NULL);
+	}
+	i = b->jspt_start;
+	while (i < b->jspt_end) {
+		if (b->jspt_bufs[i] == NULL || b->jspt_lens[i] == 0) {
+			i++;
+			continue;
+		}
+		jsp_ast_t *a = jsp_arena_ast(ar);
+		if (a == NULL) {
+			break;
+		}
+		a->jspa_in = b->jspt_bufs[i];
+		a->jspa_sz = b->jspt_lens[i];
+		if (jsp_index_build(a) != 0 || jsp_arena_seal(a) != 0) {
+			jsp_arena_discard(a);
+			i++;
+			continue;
+		}
+		b->jspt_out[i] = a;
+		b->jspt_nparsed++;
+		i++;
+	}
+	jsp_arena_done(ar);
+	return (NULL);
+}
+
+size_t
+jsp_parse_batch_mt(char **bufs, size_t *lens, size_t n, jsp_ast_t **out,
+    uint32_t nthr)
+{
+	if (n == 0) {
+		return (0);
+	}
+	if (nthr == 0) {
+		nthr = 1;
+	}
+	if (nthr > n) {
+		nthr = n;
+	}
+	jsp_batch_t one;
+	jsp_batch_t *b = &one;
+	if (nthr > 1) {
+		b = calloc(nthr, sizeof (jsp_batch_t));
+		if (b == NULL) {
+			b = &one;
+			nthr = 1;
+		}
+	}
+
+	size_t per = n / nthr;
+	size_t extra = n % nthr;
+	size_t start = 0;
+	uint32_t t = 0;
+	while (t < nthr) {
+		b[t].jspt_bufs = bufs;
+		b[t].jspt_lens = lens;
+		b[t].jspt_out = out;
+		b[t].jspt_start = start;
+		start += per + (t < extra ? 1 : 0);
+		b[t].jspt_end = start;
+		b[t].jspt_started = t > 0 && pthread_create(&b[t].jspt_tid,
+		    NULL, jsp_batch_range, &b[t]) == 0;
+		t++;
+	}
+	(void) jsp_batch_range(&b[0]);
+
+	size_t r = 0;
+	t = 0;
+	while (t < nthr) {
+		if (t > 0 && b[t].jspt_started) {
+			(void) pthread_join(b[t].jspt_tid, NULL);
+		} else if (t > 0) {
+			(void) jsp_batch_range(&b[t]);
+		}
+		r += b[t].jspt_nparsed;
+		t++;
+	}
+	if (b != &one) {
+		free(b);
+	}
+	return (r);
+}
+
+size_t
+jsp_parse_batch(char **bufs, size_t *lens, size_t n, jsp_ast_t **out)
+{
+	return (jsp_parse_batch_mt(bufs, lens, n, out, 1));
+}
@@ -0,0 +1,973 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include "jsonparse_impl.h"
+
+/*
+ * Editing Documents
+ * =================
+ *
+ * A parsed document can be edited in place: values can be replaced, members
+ * inserted and deleted, elements appended, and whole RFC 6902 JSON Patches
+ * applied. None of this touches the input buffer. Instead, the text of any new
+ * value is copied into the AST's edit buffer, and indexed with the same
+ * scanner that indexed the input. Its nodes are flagged (VEDIT/KEDIT) so that
+ * we know which buffer their spans refer to. The new node is then linked in
+ * where the old one was, and the old one is simply unlinked, and left to be
+ * freed with the AST.
+ *
+ * Every container whose list of children changed is flagged DIRTY, as are
+ * all of its ancestors. Reserializing a document is then a matter of copying
+ * the spans of clean nodes verbatim, and only re-emitting the brackets of the
+ * dirty ones, and the keys and commas around the children that changed. An
+ * edit dirties one path from the root, so the re-encoding work is
+ * proportional to the edit, and the rest is memcpy.
+ *
+ * Siblings are doubly linked, and containers know their last child, so an
+ * edit links or unlinks a node without walking its siblings.
+ *
+ * Edits leave walkers that were on a deleted or replaced value (or anywhere
+ * inside one) stale. The edit functions fail on a stale walker, which must
+ * be reset first; see jsp_walk_cur().
+ *
+ * Keys passed to this API are raw, just like in jsp_walk_member(): they are
+ * the bytes that go between the quotes, and must already be escaped.
+ */
+
+static uint32_t *
+jsp_jfield(jsp_ast_t *a, uint32_t i, jsp_jfield_t f)
+{
+	jsp_node_t *n = JSP_NODE(a, i);
+	switch (f) {
+	case JSP_JCHILD:
+		return (&n->jspn_child);
+	case JSP_JTAIL:
+		return (&n->jspn_tail);
+	case JSP_JNEXT:
+		return (&n->jspn_next);
+	case JSP_JPREV:
+		return (&n->jspn_prev);
+	case JSP_JPARENT:
+		return (&n->jspn_parent);
+	case JSP_JFLAGS:
+		return (&n->jspn_flags);
+	default:
+		return (&a->jspa_root);
+	}
+}
+
+/*
+ * All changes to the links and flags of existing nodes go through here, so
+ * that they can be journaled if we are in the middle of a patch. Nodes that
+ * were created by the patch itself don't strictly need journaling, but it
+ * doesn't hurt.
+ */
+static int
+jsp_jset(jsp_ast_t *a, uint32_t i, jsp_jfield_t f, uint32_t v)
+{
+	uint32_t *p = jsp_jfield(a, i, f);
+	if (a->jspa_jnl_on) {
+		if (a->jspa_njnl == a->jspa_maxjnl) {
+			uint32_t max = a->jspa_maxjnl ? a->jspa_maxjnl * 2 : 64;
+			jsp_jent_t *jnl = jsp_mem_realloc(a, a->jspa_jnl,
+			    a->jspa_maxjnl * sizeof (jsp_jent_t),
+			    max * sizeof (jsp_jent_t));
+			if (jnl == NULL) {
+				return (-1);
+			}
+			a->jspa_jnl = jnl;
+			a->jspa_maxjnl = max;
+			p = jsp_jfield(a, i, f);
+		}
+		jsp_jent_t *e = &a->jspa_jnl[a->jspa_njnl++];
+		e->jspj_node = i;
+		e->jspj_field = f;
+		e->jspj_old = *p;
+	}
+	*p = v;
+	return (0);
+}
+
+static int
+jsp_ebuf_add(jsp_ast_t *a, char *b, size_t sz, size_t *off)
+{
+	if (a->jspa_emax - a->jspa_esz < sz) {
+		size_t max = a->jspa_emax ? a->jspa_emax : 4096;
+		while (max - a->jspa_esz < sz) {
+			max *= 2;
+		}
+		char *e = jsp_mem_realloc(a, a->jspa_ebuf, a->jspa_emax, max);
+		if (e == NULL) {
+			return (-1);
+		}
+		a->jspa_ebuf = e;
+		a->jspa_emax = max;
+	}
+	*off = a->jspa_esz;
+	bcopy(b, a->jspa_ebuf + a->jspa_esz, sz);
+	a->jspa_esz += sz;
+	return (0);
+}
+
+/*
+ * Copies `json` into the edit buffer, and indexes it. The new value isn't
+ * linked into the document yet, but `par` is the container it is going into
+ * (or JSP_NONE, for a new root), so that the nesting limit counts the
+ * containers it will be inside.
+ */
+static int
+jsp_edit_new(jsp_ast_t *a, uint32_t par, char *json, size_t sz,
+    uint32_t *idx)
+{
+	size_t off;
+	if (json == NULL || sz == 0 || jsp_ebuf_add(a, json, sz, &off) != 0) {
+		return (-1);
+	}
+	return (jsp_index_scan(a, a->jspa_ebuf, off, off + sz, JSP_NONE,
+	    jsp_index_depth(a, par), JSPN_VEDIT | JSPN_KEDIT, idx));
+}
+
+/*
+ * Gives a freshly created node a key. We store the key with its quotes, so
+ * that we can check that it is a well-formed JSON string.
+ */
+static int
+jsp_edit_key(jsp_ast_t *a, uint32_t idx, char *key, size_t sz)
+{
+	size_t off;
+	size_t ignore;
+	uint32_t kid = JSP_NOKEY;
+	if (sz > UINT32_MAX || jsp_ebuf_add(a, "\"", 1, &off) != 0 ||
+	    jsp_ebuf_add(a, key, sz, &ignore) != 0 ||
+	    jsp_ebuf_add(a, "\"", 1, &ignore) != 0) {
+		return (-1);
+	}
+	if (jsp_index_scan(NULL, a->jspa_ebuf, off, off + sz + 2, JSP_NONE, 0,
+	    0, &kid) != 0) {
+		return (-1);
+	}
+	kid = JSP_NOKEY;
+	if (a->jspa_dict != NULL &&
+	    jsp_keydict_add(a->jspa_dict, key, sz, &kid, a) != 0) {
+		return (-1);
+	}
+	jsp_node_t *n = JSP_NODE(a, idx);
+	n->jspn_koff = off + 1 - JSP_DELTA(a, idx);
+	n->jspn_klen = sz;
+	n->jspn_kid = kid;
+	n->jspn_flags |= JSPN_KEDIT;
+	return (0);
+}
+
+/*
+ * Flags the container `idx` and all of its ancestors as dirty, and drops
+ * their cached hashes.
+ */
+static int
+jsp_edit_dirty(jsp_ast_t *a, uint32_t idx)
+{
+	while (idx != JSP_NONE) {
+		jsp_node_t *n = JSP_NODE(a, idx);
+		if ((n->jspn_flags & (JSPN_DIRTY | JSPN_HASHED)) !=
+		    JSPN_DIRTY && jsp_jset(a, idx, JSP_JFLAGS,
+		    (n->jspn_flags | JSPN_DIRTY) & ~JSPN_HASHED) != 0) {
+			return (-1);
+		}
+		idx = JSP_NODE(a, idx)->jspn_parent;
+	}
+	return (0);
+}
+
+static uint32_t
+jsp_edit_find(jsp_ast_t *a, uint32_t obj, char *key, size_t sz)
+{
+	uint32_t c = JSP_NODE(a, obj)->jspn_child;
+	while (c != JSP_NONE) {
+		jsp_node_t *n = JSP_NODE(a, c);
+		if (n->jspn_klen == sz && memcmp(JSP_KEY(a, c), key, sz) == 0) {
+			return (c);
+		}
+		c = n->jspn_next;
+	}
+	return (JSP_NONE);
+}
+
+/*
+ * Links `idx` into the children of `par`, just before `before`, or at the end
+ * if `before` is JSP_NONE.
+ */
+static int
+jsp_edit_link(jsp_ast_t *a, uint32_t par, uint32_t before, uint32_t idx)
+{
+	uint32_t prev = JSP_NODE(a, par)->jspn_tail;
+	if (before != JSP_NONE) {
+		jsp_node_t *b = JSP_NODE(a, before);
+		if (b->jspn_parent != par || (b->jspn_flags & JSPN_DEAD)) {
+			return (-1);
+		}
+		prev = b->jspn_prev;
+	}
+	if (jsp_jset(a, idx, JSP_JPARENT, par) != 0 ||
+	    jsp_jset(a, idx, JSP_JNEXT, before) != 0 ||
+	    jsp_jset(a, idx, JSP_JPREV, prev) != 0) {
+		return (-1);
+	}
+	if (prev == JSP_NONE) {
+		if (jsp_jset(a, par, JSP_JCHILD, idx) != 0) {
+			return (-1);
+		}
+	} else if (jsp_jset(a, prev, JSP_JNEXT, idx) != 0) {
+		return (-1);
+	}
+	if (before == JSP_NONE) {
+		if (jsp_jset(a, par, JSP_JTAIL, idx) != 0) {
+			return (-1);
+		}
+	} else if (jsp_jset(a, before, JSP_JPREV, idx) != 0) {
+		return (-1);
+	}
+	return (jsp_edit_dirty(a, par));
+}
+
+static int
+jsp_edit_unlink(jsp_ast_t *a, uint32_t idx)
+{
+	jsp_node_t *n = JSP_NODE(a, idx);
+	uint32_t par = n->jspn_parent;
+	uint32_t next = n->jspn_next;
+	uint32_t prev = n->jspn_prev;
+	if (par == JSP_NONE || (n->jspn_flags & JSPN_DEAD)) {
+		return (-1);
+	}
+	if (prev == JSP_NONE) {
+		if (jsp_jset(a, par, JSP_JCHILD, next) != 0) {
+			return (-1);
+		}
+	} else if (jsp_jset(a, prev, JSP_JNEXT, next) != 0) {
+		return (-1);
+	}
+	if (next == JSP_NONE) {
+		if (jsp_jset(a, par, JSP_JTAIL, prev) != 0) {
+			return (-1);
+		}
+	} else if (jsp_jset(a, next, JSP_JPREV, prev) != 0) {
+		return (-1);
+	}
+	if (jsp_jset(a, idx, JSP_JFLAGS,
+	    JSP_NODE(a, idx)->jspn_flags | JSPN_DEAD) != 0) {
+		return (-1);
+	}
+	return (jsp_edit_dirty(a, par));
+}
+
+/*
+ * Puts the fresh node `new` where `old` was, key and all.
+ */
+static int
+jsp_edit_swap(jsp_ast_t *a, uint32_t old, uint32_t new)
+{
+	jsp_node_t *o = JSP_NODE(a, old);
+	jsp_node_t *n = JSP_NODE(a, new);
+	if (o->jspn_parent == JSP_NONE) {
+		if (jsp_jset(a, old, JSP_JFLAGS, o->jspn_flags | JSPN_DEAD) !=
+		    0) {
+			return (-1);
+		}
+		return (jsp_jset(a, 0, JSP_JROOT, new));
+	}
+	n->jspn_koff = JSP_KOFF(a, old) - JSP_DELTA(a, new);
+	n->jspn_klen = o->jspn_klen;
+	n->jspn_kid = o->jspn_kid;
+	n->jspn_flags = (n->jspn_flags & ~JSPN_KEDIT) |
+	    (o->jspn_flags & JSPN_KEDIT);
+	if (jsp_edit_link(a, o->jspn_parent, old, new) != 0) {
+		return (-1);
+	}
+	return (jsp_edit_unlink(a, old));
+}
+
+void
+jsp_wbuf_put(jsp_wbuf_t *b, char *p, size_t sz)
+{
+	if (b->jspb_off < b->jspb_sz) {
+		size_t n = b->jspb_sz - b->jspb_off;
+		bcopy(p, b->jspb_out + b->jspb_off, n < sz ? n : sz);
+	}
+	b->jspb_off += sz;
+}
+
+/*
+ * Clean nodes are copied verbatim. Dirty ones have their brackets re-emitted,
+ * and the keys and commas around any of their children that were moved,
+ * replaced, or added. Children that are still as they were in the input,
+ * and that were next to each other in it, are copied as a single span,
+ * separators and all. The scanner adds a node's next sibling right after the
+ * node's subtree, so that is the case if each is clean, comes from the input,
+ * and has the index that follows the previous one's `last`.
+ */
+static void
+jsp_emit(jsp_ast_t *a, uint32_t idx, jsp_wbuf_t *b)
+{
+	jsp_node_t *n = JSP_NODE(a, idx);
+	if (!(n->jspn_flags & JSPN_DIRTY)) {
+		jsp_wbuf_put(b, JSP_VAL(a, idx), n->jspn_len);
+		return;
+	}
+	uint32_t mask = JSPN_DIRTY | JSPN_VEDIT | JSPN_KEDIT;
+	int obj = n->jspn_type == OBJECT;
+	char *run = NULL;
+	char *end = NULL;
+	uint32_t after = JSP_NONE;
+	jsp_wbuf_put(b, obj ? "{" : "[", 1);
+	uint32_t c = n->jspn_child;
+	while (c != JSP_NONE) {
+		jsp_node_t *cn = JSP_NODE(a, c);
+		int clean = !(cn->jspn_flags & mask);
+		if (run != NULL && clean && c == after) {
+			end = JSP_VAL(a, c) + cn->jspn_len;
+		} else {
+			if (run != NULL) {
+				jsp_wbuf_put(b, run, end - run);
+				run = NULL;
+			}
+			if (c != n->jspn_child) {
+				jsp_wbuf_put(b, ",", 1);
+			}
+			if (clean) {
+				run = obj ? JSP_KEY(a, c) - 1 : JSP_VAL(a, c);
+				end = JSP_VAL(a, c) + cn->jspn_len;
+			} else {
+				if (obj) {
+					jsp_wbuf_put(b, "\"", 1);
+					jsp_wbuf_put(b, JSP_KEY(a, c),
+					    cn->jspn_klen);
+					jsp_wbuf_put(b, "\":", 2);
+				}
+				jsp_emit(a, c, b);
+			}
+		}
+		after = cn->jspn_last + 1;
+		c = cn->jspn_next;
+	}
+	if (run != NULL) {
+		jsp_wbuf_put(b, run, end - run);
+	}
+	jsp_wbuf_put(b, obj ? "}" : "]", 1);
+}
+
+/*
+ * Serializes the (possibly edited) document into `out`, writing at most `sz`
+ * bytes. Returns the size of the whole serialization, so that the caller can
+ * find out how big a buffer it needs by passing a NULL `out` and 0 `sz`.
+ */
+size_t
+jsp_serialize(jsp_ast_t *a, char *out, size_t sz)
+{
+	jsp_wbuf_t b;
+	b.jspb_out = out;
+	b.jspb_sz = out == NULL ? 0 : sz;
+	b.jspb_off = 0;
+	jsp_emit(a, a->jspa_root, &b);
+	return (b.jspb_off);
+}
+
+/*
+ * Serializes a subtree into a freshly allocated buffer.
+ */
+static char *
+jsp_emit_alloc(jsp_ast_t *a, uint32_t idx, size_t *sz)
+{
+	jsp_wbuf_t b;
+	b.jspb_out = NULL;
+	b.jspb_sz = 0;
+	b.jspb_off = 0;
+	jsp_emit(a, idx, &b);
+	b.jspb_out = malloc(b.jspb_off);
+	if (b.jspb_out == NULL) {
+		return (NULL);
+	}
+	b.jspb_sz = b.jspb_off;
+	b.jspb_off = 0;
+	jsp_emit(a, idx, &b);
+	*sz = b.jspb_off;
+	return (b.jspb_out);
+}
+
+/*
+ * Returns the node that `w` is on, or JSP_NONE if the walker is stale: its
+ * value was deleted or replaced by an edit (or lies within one that was), or
+ * the index was rebuilt since it was positioned. A stale walker must be
+ * reset before it can be used again.
+ */
+uint32_t
+jsp_walk_cur(jsp_ast_t *a, jsp_walk_t *w)
+{
+	if (w->jspw_tree != a || w->jspw_cur == JSP_NONE) {
+		w->jspw_tree = a;
+		w->jspw_cur = a->jspa_root;
+		w->jspw_gen = a->jspa_gen;
+		return (w->jspw_cur);
+	}
+	if (w->jspw_gen != a->jspa_gen) {
+		return (JSP_NONE);
+	}
+	uint32_t c = w->jspw_cur;
+	for (;;) {
+		jsp_node_t *n = JSP_NODE(a, c);
+		if (n->jspn_flags & JSPN_DEAD) {
+			return (JSP_NONE);
+		}
+		if (n->jspn_parent == JSP_NONE) {
+			return (c == a->jspa_root ? w->jspw_cur : JSP_NONE);
+		}
+		c = n->jspn_parent;
+	}
+}
+
+/*
+ * Replaces the value that `w` is on with `json`. The walker is moved to the
+ * new value.
+ */
+int
+jsp_set_value(jsp_ast_t *a, jsp_walk_t *w, char *json, size_t sz)
+{
+	uint32_t cur = jsp_walk_cur(a, w);
+	uint32_t new;
+	if (cur == JSP_NONE || jsp_edit_new(a, JSP_NODE(a, cur)->jspn_parent,
+	    json, sz, &new) != 0 || jsp_edit_swap(a, cur, new) != 0) {
+		return (-1);
+	}
+	w->jspw_cur = new;
+	return (0);
+}
+
+/*
+ * Sets the member `key` of the object that `w` is on to `json`. If there is
+ * no such member, it is appended.
+ */
+int
+jsp_insert_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t ksz,
+    char *json, size_t sz)
+{
+	uint32_t obj = jsp_walk_cur(a, w);
+	uint32_t new;
+	if (obj == JSP_NONE || JSP_NODE(a, obj)->jspn_type != OBJECT ||
+	    jsp_edit_new(a, obj, json, sz, &new) != 0 ||
+	    jsp_edit_key(a, new, key, ksz) != 0) {
+		return (-1);
+	}
+	uint32_t old = jsp_edit_find(a, obj, key, ksz);
+	if (old != JSP_NONE) {
+		return (jsp_edit_swap(a, old, new));
+	}
+	return (jsp_edit_link(a, obj, JSP_NONE, new));
+}
+
+/*
+ * Removes the member `key` from the object that `w` is on. Returns -1 if there
+ * is no such member.
+ */
+int
+jsp_delete_member(jsp_ast_t *a, jsp_walk_t *w, char *key, size_t ksz)
+{
+	uint32_t obj = jsp_walk_cur(a, w);
+	if (obj == JSP_NONE || JSP_NODE(a, obj)->jspn_type != OBJECT) {
+		return (-1);
+	}
+	uint32_t old = jsp_edit_find(a, obj, key, ksz);
+	if (old == JSP_NONE) {
+		return (-1);
+	}
+	return (jsp_edit_unlink(a, old));
+}
+
+/*
+ * Appends `json` to the array that `w` is on.
+ */
+int
+jsp_append_value(jsp_ast_t *a, jsp_walk_t *w, char *json, size_t sz)
+{
+	uint32_t arr = jsp_walk_cur(a, w);
+	uint32_t new;
+	if (arr == JSP_NONE || JSP_NODE(a, arr)->jspn_type != ARRAY ||
+	    jsp_edit_new(a, arr, json, sz, &new) != 0) {
+		return (-1);
+	}
+	return (jsp_edit_link(a, arr, JSP_NONE, new));
+}
+
+/*
+ * Numbers that aren't byte-for-byte identical may still be numerically equal
+ * (1.0 and 1e0, say). Short of writing our own decimal comparison, strtod is
+ * the best we can do.
+ */
+static int
+jsp_num_equal(char *n1, size_t s1, char *n2, size_t s2)
+{
+	char b1[64];
+	char b2[64];
+	if (s1 >= sizeof (b1) || s2 >= sizeof (b2)) {
+		return (0);
+	}
+	bcopy(n1, b1, s1);
+	bcopy(n2, b2, s2);
+	b1[s1] = '\0';
+	b2[s2] = '\0';
+	return (strtod(b1, NULL) == strtod(b2, NULL));
+}
+
+/*
+ * Objects with at most this many members are compared without allocating.
+ */
+#define	JSP_EQ_STACK	8
+
+/*
+ * Structural equality, as defined by RFC 6902's "test" operation: object
+ * members may appear in any order, strings are compared byte-for-byte, and
+ * numbers by value. Values whose hashes are both cached, and differ, can't be
+ * equal, so we don't need to look any further.
+ *
+ * To compare objects, we sort the members of both by key, and walk the two
+ * lists in step. The sort keeps ties in document order, so a key that appears
+ * more than once is matched up by position: the first "a" of one object with
+ * the first "a" of the other, and so on. Returns 1 if the values are equal,
+ * 0 if they aren't, and -1, with errno set to ENOMEM, if we couldn't
+ * allocate the space to sort a large object.
+ */
+int
+jsp_node_equal(jsp_ast_t *a1, uint32_t i1, jsp_ast_t *a2, uint32_t i2)
+{
+	jsp_node_t *n1 = JSP_NODE(a1, i1);
+	jsp_node_t *n2 = JSP_NODE(a2, i2);
+	if ((n1->jspn_flags & n2->jspn_flags & JSPN_HASHED) &&
+	    n1->jspn_hash != n2->jspn_hash) {
+		return (0);
+	}
+	int num1 = n1->jspn_type == INTEGER || n1->jspn_type == FLOAT;
+	int num2 = n2->jspn_type == INTEGER || n2->jspn_type == FLOAT;
+	if (num1 && num2) {
+		return ((n1->jspn_len == n2->jspn_len &&
+		    memcmp(JSP_VAL(a1, i1), JSP_VAL(a2, i2),
+		    n1->jspn_len) == 0) ||
+		    jsp_num_equal(JSP_VAL(a1, i1), n1->jspn_len,
+		    JSP_VAL(a2, i2), n2->jspn_len));
+	}
+	if (n1->jspn_type != n2->jspn_type) {
+		return (0);
+	}
+	uint32_t c1 = n1->jspn_child;
+	uint32_t c2 = n2->jspn_child;
+	int r;
+	switch (n1->jspn_type) {
+	case ARRAY:
+		while (c1 != JSP_NONE && c2 != JSP_NONE) {
+			if ((r = jsp_node_equal(a1, c1, a2, c2)) != 1) {
+				return (r);
+			}
+			c1 = JSP_NODE(a1, c1)->jspn_next;
+			c2 = JSP_NODE(a2, c2)->jspn_next;
+		}
+		return (c1 == JSP_NONE && c2 == JSP_NONE);
+	case OBJECT:
+		break;
+	default:
+		return (n1->jspn_len == n2->jspn_len &&
+		    memcmp(JSP_VAL(a1, i1), JSP_VAL(a2, i2),
+		    n1->jspn_len) == 0);
+	}
+
+	uint32_t cnt = 0;
+	while (c1 != JSP_NONE && c2 != JSP_NONE) {
+		cnt++;
+		c1 = JSP_NODE(a1, c1)->jspn_next;
+		c2 = JSP_NODE(a2, c2)->jspn_next;
+	}
+	if (c1 != JSP_NONE || c2 != JSP_NONE) {
+		return (0);
+	}
+	uint32_t sv[3 * JSP_EQ_STACK];
+	uint32_t *v = sv;
+	if (cnt > JSP_EQ_STACK &&
+	    (v = malloc(3 * (size_t)cnt * sizeof (uint32_t))) == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	uint32_t i = 0;
+	c1 = n1->jspn_child;
+	c2 = n2->jspn_child;
+	while (c1 != JSP_NONE) {
+		v[i] = c1;
+		v[cnt + i++] = c2;
+		c1 = JSP_NODE(a1, c1)->jspn_next;
+		c2 = JSP_NODE(a2, c2)->jspn_next;
+	}
+	jsp_canon_sort(a1, v, v + 2 * cnt, cnt);
+	jsp_canon_sort(a2, v + cnt, v + 2 * cnt, cnt);
+	r = 1;
+	for (i = 0; i < cnt && r == 1; i++) {
+		c1 = v[i];
+		c2 = v[cnt + i];
+		uint32_t klen = JSP_NODE(a1, c1)->jspn_klen;
+		if (klen != JSP_NODE(a2, c2)->jspn_klen ||
+		    memcmp(JSP_KEY(a1, c1), JSP_KEY(a2, c2), klen) != 0) {
+			r = 0;
+		} else {
+			r = jsp_node_equal(a1, c1, a2, c2);
+		}
+	}
+	if (v != sv) {
+		free(v);
+	}
+	return (r);
+}
+
+/*
+ * JSON Pointers
+ * =============
+ *
+ * A pointer (RFC 6901) is a sequence of '/'-prefixed reference tokens, in
+ * which '~1' stands for '/' and '~0' for '~'. We compare tokens against the
+ * raw bytes of keys, so a key that contains JSON escapes can only be reached
+ * by spelling the escapes out in the pointer.
+ */
+static int
+jsp_ptr_keyeq(char *key, size_t ksz, char *tok, size_t tsz)
+{
+	size_t k = 0;
+	size_t t = 0;
+	while (k < ksz && t < tsz) {
+		char c = tok[t++];
+		if (c == '~' && t < tsz) {
+			c = tok[t++] == '1' ? '/' : '~';
+		}
+		if (key[k++] != c) {
+			return (0);
+		}
+	}
+	return (k == ksz && t == tsz);
+}
+
+static size_t
+jsp_ptr_unescape(char *tok, size_t tsz, char *out)
+{
+	size_t t = 0;
+	size_t o = 0;
+	while (t < tsz) {
+		char c = tok[t++];
+		if (c == '~' && t < tsz) {
+			c = tok[t++] == '1' ? '/' : '~';
+		}
+		out[o++] = c;
+	}
+	return (o);
+}
+
+static int
+jsp_ptr_index(char *tok, size_t tsz, uint32_t *ix)
+{
+	uint64_t v = 0;
+	size_t i = 0;
+	if (tsz == 0 || (tsz > 1 && tok[0] == '0')) {
+		return (-1);
+	}
+	while (i < tsz) {
+		if (tok[i] < '0' || tok[i] > '9') {
+			return (-1);
+		}
+		v = v * 10 + (tok[i] - '0');
+		if (v >= JSP_NONE) {
+			return (-1);
+		}
+		i++;
+	}
+	*ix = v;
+	return (0);
+}
+
+/*
+ * Returns the child of `par` that `tok` refers to, or JSP_NONE.
+ */
+static uint32_t
+jsp_ptr_step(jsp_ast_t *a, uint32_t par, char *tok, size_t tsz)
+{
+	jsp_node_t *p = JSP_NODE(a, par);
+	uint32_t c = p->jspn_child;
+	uint32_t ix;
+	if (p->jspn_type == OBJECT) {
+		while (c != JSP_NONE) {
+			jsp_node_t *n = JSP_NODE(a, c);
+			if (jsp_ptr_keyeq(JSP_KEY(a, c), n->jspn_klen, tok,
+			    tsz)) {
+				return (c);
+			}
+			c = n->jspn_next;
+		}
+		return (JSP_NONE);
+	}
+	if (p->jspn_type != ARRAY || jsp_ptr_index(tok, tsz, &ix) != 0) {
+		return (JSP_NONE);
+	}
+	while (c != JSP_NONE && ix > 0) {
+		c = JSP_NODE(a, c)->jspn_next;
+		ix--;
+	}
+	return (c);
+}
+
+static uint32_t
+jsp_ptr_resolve(jsp_ast_t *a, char *ptr, size_t sz)
+{
+	uint32_t cur = a->jspa_root;
+	size_t i = 0;
+	if (sz > 0 && ptr[0] != '/') {
+		return (JSP_NONE);
+	}
+	while (i < sz && cur != JSP_NONE) {
+		size_t start = ++i;
+		while (i < sz && ptr[i] != '/') {
+			i++;
+		}
+		cur = jsp_ptr_step(a, cur, ptr + start, i - start);
+	}
+	return (cur);
+}
+
+/*
+ * The "add" operation: `json` is added to the container that the pointer's
+ * parent refers to, replacing the member of the same name, or being inserted
+ * before the element of the same index.
+ */
+static int
+jsp_patch_add(jsp_ast_t *a, char *path, size_t psz, char *json, size_t sz)
+{
+	uint32_t new;
+	if (psz == 0) {
+		if (jsp_edit_new(a, JSP_NONE, json, sz, &new) != 0) {
+			return (-1);
+		}
+		return (jsp_edit_swap(a, a->jspa_root, new));
+	}
+	size_t slash = psz - 1;
+	while (path[slash] != '/') {
+		if (slash == 0) {
+			return (-1);
+		}
+		slash--;
+	}
+	char *tok = path + slash + 1;
+	size_t tsz = psz - slash - 1;
+	uint32_t par = jsp_ptr_resolve(a, path, slash);
+	if (par == JSP_NONE || jsp_edit_new(a, par, json, sz, &new) != 0) {
+		return (-1);
+	}
+	jsp_node_t *p = JSP_NODE(a, par);
+	if (p->jspn_type == OBJECT) {
+		char *key = malloc(tsz + 1);
+		if (key == NULL) {
+			return (-1);
+		}
+		size_t ksz = jsp_ptr_unescape(tok, tsz, key);
+		int r = jsp_edit_key(a, new, key, ksz);
+		uint32_t old = jsp_edit_find(a, par, key, ksz);
+		free(key);
+		if (r != 0) {
+			return (-1);
+		}
+		if (old != JSP_NONE) {
+			return (jsp_edit_swap(a, old, new));
+		}
+		return (jsp_edit_link(a, par, JSP_NONE, new));
+	}
+	if (p->jspn_type != ARRAY) {
+		return (-1);
+	}
+	if (tsz == 1 && tok[0] == '-') {
+		return (jsp_edit_link(a, par, JSP_NONE, new));
+	}
+	uint32_t ix;
+	if (jsp_ptr_index(tok, tsz, &ix) != 0) {
+		return (-1);
+	}
+	uint32_t c = p->jspn_child;
+	while (c != JSP_NONE && ix > 0) {
+		c = JSP_NODE(a, c)->jspn_next;
+		ix--;
+	}
+	if (ix > 0) {
+		return (-1);
+	}
+	return (jsp_edit_link(a, par, c, new));
+}
+
+/*
+ * Returns the member `key` of the object `obj` in the patch, or JSP_NONE. If
+ * `str` is set, the member must be a string.
+ */
+static uint32_t
+jsp_patch_member(jsp_ast_t *p, uint32_t obj, char *key, int str)
+{
+	uint32_t m = jsp_edit_find(p, obj, key, strlen(key));
+	if (m != JSP_NONE && str && JSP_NODE(p, m)->jspn_type != STRING) {
+		return (JSP_NONE);
+	}
+	return (m);
+}
+
+#define	JSP_STR(a, i)	(JSP_VAL((a), (i)) + 1)
+#define	JSP_STRLEN(n)	((n)->jspn_len - 2)
+
+static int
+jsp_patch_op(jsp_ast_t *a, jsp_ast_t *p, uint32_t op)
+{
+	if (JSP_NODE(p, op)->jspn_type != OBJECT) {
+		return (-1);
+	}
+	uint32_t o = jsp_patch_member(p, op, "op", 1);
+	uint32_t pa = jsp_patch_member(p, op, "path", 1);
+	uint32_t f = jsp_patch_member(p, op, "from", 1);
+	uint32_t v = jsp_patch_member(p, op, "value", 0);
+	if (o == JSP_NONE || pa == JSP_NONE) {
+		return (-1);
+	}
+	jsp_node_t *on = JSP_NODE(p, o);
+	jsp_node_t *pn = JSP_NODE(p, pa);
+	char *name = JSP_STR(p, o);
+	size_t nsz = JSP_STRLEN(on);
+	char *path = JSP_STR(p, pa);
+	size_t psz = JSP_STRLEN(pn);
+	char *from = NULL;
+	size_t fsz = 0;
+	char *val = NULL;
+	size_t vsz = 0;
+	uint32_t t;
+	uint32_t new;
+	int r;
+
+	if (f != JSP_NONE) {
+		from = JSP_STR(p, f);
+		fsz = JSP_STRLEN(JSP_NODE(p, f));
+	}
+	if (v != JSP_NONE) {
+		val = JSP_VAL(p, v);
+		vsz = JSP_NODE(p, v)->jspn_len;
+	}
+
+	if (nsz == 3 && bcmp(name, "add", 3) == 0) {
+		if (val == NULL) {
+			return (-1);
+		}
+		return (jsp_patch_add(a, path, psz, val, vsz));
+	}
+	if (nsz == 6 && bcmp(name, "remove", 6) == 0) {
+		t = jsp_ptr_resolve(a, path, psz);
+		if (t == JSP_NONE) {
+			return (-1);
+		}
+		return (jsp_edit_unlink(a, t));
+	}
+	if (nsz == 7 && bcmp(name, "replace", 7) == 0) {
+		t = jsp_ptr_resolve(a, path, psz);
+		if (t == JSP_NONE || val == NULL ||
+		    jsp_edit_new(a, JSP_NODE(a, t)->jspn_parent, val, vsz,
+		    &new) != 0) {
+			return (-1);
+		}
+		return (jsp_edit_swap(a, t, new));
+	}
+	if (nsz == 4 && bcmp(name, "test", 4) == 0) {
+		t = jsp_ptr_resolve(a, path, psz);
+		if (t == JSP_NONE || v == JSP_NONE ||
+		    jsp_node_equal(a, t, p, v) != 1) {
+			return (-1);
+		}
+		return (0);
+	}
+	int move = nsz == 4 && bcmp(name, "move", 4) == 0;
+	int copy = nsz == 4 && bcmp(name, "copy", 4) == 0;
+	if ((!move && !copy) || from == NULL) {
+		return (-1);
+	}
+	if (move && fsz == psz && bcmp(from, path, fsz) == 0) {
+		return (0);
+	}
+	if (move && psz > fsz && path[fsz] == '/' &&
+	    bcmp(from, path, fsz) == 0) {
+		return (-1);
+	}
+	t = jsp_ptr_resolve(a, from, fsz);
+	if (t == JSP_NONE) {
+		return (-1);
+	}
+	/*
+	 * We move and copy by reserializing the source into the edit buffer.
+	 * This way, every node we link into the document is fresh, and we
+	 * never have to change the key of an existing node.
+	 */
+	val = jsp_emit_alloc(a, t, &vsz);
+	if (val == NULL) {
+		return (-1);
+	}
+	r = 0;
+	if (move) {
+		r = jsp_edit_unlink(a, t);
+	}
+	if (r == 0) {
+		r = jsp_patch_add(a, path, psz, val, vsz);
+	}
+	free(val);
+	return (r);
+}
+
+static void
+jsp_patch_rollback(jsp_ast_t *a, uint32_t nnodes, size_t esz)
+{
+	while (a->jspa_njnl > 0) {
+		jsp_jent_t *e = &a->jspa_jnl[--a->jspa_njnl];
+		*jsp_jfield(a, e->jspj_node, e->jspj_field) = e->jspj_old;
+	}
+	a->jspa_nnodes = nnodes;
+	a->jspa_esz = esz;
+}
+
+/*
+ * Applies an RFC 6902 JSON Patch to the document. Either all of the
+ * operations succeed, or the document is left as it was and we return -1.
+ */
+int
+jsp_apply_patch(jsp_ast_t *a, char *patch, size_t sz)
+{
+	jsp_ast_t p;
+	bzero(&p, sizeof (p));
+	p.jspa_in = patch;
+	p.jspa_sz = sz;
+	if (patch == NULL || sz == 0 || jsp_index_build(&p) != 0 ||
+	    JSP_NODE(&p, p.jspa_root)->jspn_type != ARRAY) {
+		jsp_chunks_free(&p);
+		return (-1);
+	}
+
+	uint32_t nnodes = a->jspa_nnodes;
+	size_t esz = a->jspa_esz;
+	int r = 0;
+	a->jspa_jnl_on = 1;
+	a->jspa_njnl = 0;
+	uint32_t op = JSP_NODE(&p, p.jspa_root)->jspn_child;
+	while (op != JSP_NONE) {
+		r = jsp_patch_op(a, &p, op);
+		if (r != 0) {
+			jsp_patch_rollback(a, nnodes, esz);
+			break;
+		}
+		op = JSP_NODE(&p, op)->jspn_next;
+	}
+	a->jspa_jnl_on = 0;
+	a->jspa_njnl = 0;
+	jsp_chunks_free(&p);
+	return (r);
+}
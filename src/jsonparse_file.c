@@ -0,0 +1,528 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "jsonparse_impl.h"
+
+/*
+ * Parsing Files
+ * =============
+ *
+ * jsp_parse_file() reads a file into memory and parses it. The AST keeps the
+ * file's contents alive, and releases them when it is destroyed. There are two
+ * ways of getting the file into memory.
+ *
+ * By default, we mmap the file. We ask for the mapping to be populated up
+ * front (on systems that have MAP_POPULATE), and tell the VM system that we
+ * will read it sequentially, so that read-ahead is as aggressive as it gets.
+ * We also hint that the mapping may be backed by large pages.
+ *
+ * With JSP_FILE_URING (on Linux), we instead read the file into a heap buffer
+ * through io_uring, in JSP_URING_CHUNK sized reads. We keep two reads in
+ * flight at all times, so that the device is never idle while we reap a
+ * completion and queue up the next read. The parse doesn't wait for the whole
+ * file: the scanner starts on the first chunk as soon as it lands, and only
+ * waits when it catches up with the reads (see jsp_index_build_fill()). If
+ * io_uring is not available (forbidden by a sandbox, or a kernel older than
+ * 5.6, which doesn't have IORING_OP_READ), we quietly fall back to mmap.
+ *
+ * Reading into the heap copies every byte of the file once more than mapping
+ * it does. For a file that is already in the page cache, that copy is all the
+ * difference, and mmap wins. For one that has to come off the device, the
+ * parse of each chunk is hidden behind the reads of the ones after it.
+ */
+
+#define	JSP_URING_CHUNK	(1024 * 1024)
+#define	JSP_URING_DEPTH	2
+
+static char *
+jsp_file_mmap(int fd, size_t sz)
+{
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	char *data = mmap(NULL, sz, PROT_READ, flags, fd, 0);
+	if (data == MAP_FAILED) {
+		return (NULL);
+	}
+	(void) madvise(data, sz, MADV_SEQUENTIAL);
+#ifndef MAP_POPULATE
+	(void) madvise(data, sz, MADV_WILLNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+	(void) madvise(data, sz, MADV_HUGEPAGE);
+#endif
+	return (data);
+}
+
+#ifdef __linux__
+
+typedef struct jsp_uring {
+	int			jspu_fd;
+	void			*jspu_sq;
+	size_t			jspu_sqsz;
+	void			*jspu_cq;
+	size_t			jspu_cqsz;
+	struct io_uring_sqe	*jspu_sqes;
+	size_t			jspu_sqesz;
+	unsigned		*jspu_sqtail;
+	unsigned		*jspu_sqmask;
+	unsigned		*jspu_sqarray;
+	unsigned		*jspu_cqhead;
+	unsigned		*jspu_cqtail;
+	unsigned		*jspu_cqmask;
+	struct io_uring_cqe	*jspu_cqes;
+} jsp_uring_t;
+
+static void
+jsp_uring_fini(jsp_uring_t *u)
+{
+	if (u->jspu_sqes != NULL) {
+		(void) munmap(u->jspu_sqes, u->jspu_sqesz);
+	}
+	if (u->jspu_cq != NULL && u->jspu_cq != u->jspu_sq) {
+		(void) munmap(u->jspu_cq, u->jspu_cqsz);
+	}
+	if (u->jspu_sq != NULL) {
+		(void) munmap(u->jspu_sq, u->jspu_sqsz);
+	}
+	(void) close(u->jspu_fd);
+}
+
+/*
+ * We talk to the kernel directly, rather than through liburing, so as not to
+ * drag in another dependency for a handful of system calls.
+ */
+static int
+jsp_uring_init(jsp_uring_t *u)
+{
+	struct io_uring_params p;
+	bzero(u, sizeof (jsp_uring_t));
+	bzero(&p, sizeof (p));
+	u->jspu_fd = syscall(__NR_io_uring_setup, JSP_URING_DEPTH, &p);
+	if (u->jspu_fd < 0) {
+		return (-1);
+	}
+	u->jspu_sqsz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	u->jspu_cqsz = p.cq_off.cqes +
+	    p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->jspu_cqsz > u->jspu_sqsz) {
+			u->jspu_sqsz = u->jspu_cqsz;
+		}
+		u->jspu_cqsz = u->jspu_sqsz;
+	}
+	u->jspu_sq = mmap(NULL, u->jspu_sqsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->jspu_fd, IORING_OFF_SQ_RING);
+	if (u->jspu_sq == MAP_FAILED) {
+		u->jspu_sq = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->jspu_cq = u->jspu_sq;
+	} else {
+		u->jspu_cq = mmap(NULL, u->jspu_cqsz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->jspu_fd, IORING_OFF_CQ_RING);
+		if (u->jspu_cq == MAP_FAILED) {
+			u->jspu_cq = NULL;
+			goto fail;
+		}
+	}
+	u->jspu_sqesz = p.sq_entries * sizeof (struct io_uring_sqe);
+	u->jspu_sqes = mmap(NULL, u->jspu_sqesz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->jspu_fd, IORING_OFF_SQES);
+	if (u->jspu_sqes == MAP_FAILED) {
+		u->jspu_sqes = NULL;
+		goto fail;
+	}
+	char *sq = u->jspu_sq;
+	char *cq = u->jspu_cq;
+	u->jspu_sqtail = (unsigned *)(sq + p.sq_off.tail);
+	u->jspu_sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->jspu_sqarray = (unsigned *)(sq + p.sq_off.array);
+	u->jspu_cqhead = (unsigned *)(cq + p.cq_off.head);
+	u->jspu_cqtail = (unsigned *)(cq + p.cq_off.tail);
+	u->jspu_cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->jspu_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return (0);
+fail:
+	jsp_uring_fini(u);
+	return (-1);
+}
+
+/*
+ * IORING_OP_READ arrived in Linux 5.6; on older kernels, the first read would
+ * complete with -EINVAL. The probe arrived at the same time, so if the kernel
+ * doesn't understand it, it's too old as well.
+ */
+static int
+jsp_uring_probe(jsp_uring_t *u)
+{
+	size_t psz = sizeof (struct io_uring_probe) +
+	    (IORING_OP_READ + 1) * sizeof (struct io_uring_probe_op);
+	struct io_uring_probe *p = calloc(1, psz);
+	if (p == NULL) {
+		return (-1);
+	}
+	int r = syscall(__NR_io_uring_register, u->jspu_fd,
+	    IORING_REGISTER_PROBE, p, IORING_OP_READ + 1);
+	r = r == 0 && p->last_op >= IORING_OP_READ &&
+	    (p->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ? 0 : -1;
+	free(p);
+	return (r);
+}
+
+/*
+ * Queues (but doesn't submit) a read of `len` bytes at `off` into `buf`. The
+ * offset doubles as the user-data, so that we know which read completed.
+ */
+static void
+jsp_uring_read(jsp_uring_t *u, int fd, char *buf, size_t off, size_t len)
+{
+	unsigned tail = *u->jspu_sqtail;
+	unsigned i = tail & *u->jspu_sqmask;
+	struct io_uring_sqe *sqe = &u->jspu_sqes[i];
+	bzero(sqe, sizeof (*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->addr = (uintptr_t)(buf + off);
+	sqe->len = len;
+	sqe->user_data = off;
+	u->jspu_sqarray[i] = i;
+	__atomic_store_n(u->jspu_sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submits whatever is queued, without waiting for anything to complete.
+ * Returns the number of reads that are still queued; if the kernel wouldn't
+ * take them now, the next jsp_uring_wait() submits them.
+ */
+static unsigned
+jsp_uring_submit(jsp_uring_t *u, unsigned submit)
+{
+	while (submit > 0) {
+		int r = syscall(__NR_io_uring_enter, u->jspu_fd, submit, 0, 0,
+		    NULL, 0);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			break;
+		}
+		submit -= (unsigned)r < submit ? (unsigned)r : submit;
+	}
+	return (submit);
+}
+
+/*
+ * Submits whatever is queued, and waits for a completion. We must submit even
+ * if a completion is already waiting for us, or the queued read would be left
+ * behind.
+ */
+static int
+jsp_uring_wait(jsp_uring_t *u, unsigned submit, uint64_t *off, int *res)
+{
+	unsigned head = *u->jspu_cqhead;
+	for (;;) {
+		int empty = head ==
+		    __atomic_load_n(u->jspu_cqtail, __ATOMIC_ACQUIRE);
+		if (!empty && submit == 0) {
+			break;
+		}
+		int r = syscall(__NR_io_uring_enter, u->jspu_fd, submit,
+		    empty ? 1 : 0, empty ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r < 0 && errno != EINTR) {
+			return (-1);
+		}
+		if (r > 0) {
+			submit -= (unsigned)r < submit ? (unsigned)r : submit;
+		}
+	}
+	struct io_uring_cqe *cqe = &u->jspu_cqes[head & *u->jspu_cqmask];
+	*off = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(u->jspu_cqhead, head + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/*
+ * The state of a file that is being read through io_uring while it is parsed.
+ * `next` is where the next chunk's read will start, and `avail` is the length
+ * of the prefix of the file that has landed. Chunks can land out of order, so
+ * `done` counts the bytes that have landed in each one.
+ */
+typedef struct jsp_uread {
+	jsp_uring_t	jspr_ring;
+	int		jspr_fd;
+	char		*jspr_buf;
+	size_t		jspr_sz;
+	size_t		jspr_next;
+	size_t		jspr_avail;
+	size_t		*jspr_done;
+	unsigned	jspr_inflight;
+	unsigned	jspr_queued;
+	int		jspr_err;
+} jsp_uread_t;
+
+static size_t
+jsp_uread_chunk(jsp_uread_t *r, size_t off)
+{
+	size_t end = (off / JSP_URING_CHUNK + 1) * JSP_URING_CHUNK;
+	return ((end < r->jspr_sz ? end : r->jspr_sz) -
+	    off / JSP_URING_CHUNK * JSP_URING_CHUNK);
+}
+
+/*
+ * Queues up reads of the next chunks, until JSP_URING_DEPTH are in flight,
+ * and submits them, so that they proceed while we parse.
+ */
+static void
+jsp_uread_queue(jsp_uread_t *r)
+{
+	while (r->jspr_inflight < JSP_URING_DEPTH &&
+	    r->jspr_next < r->jspr_sz) {
+		size_t len = jsp_uread_chunk(r, r->jspr_next);
+		jsp_uring_read(&r->jspr_ring, r->jspr_fd, r->jspr_buf,
+		    r->jspr_next, len);
+		r->jspr_next += len;
+		r->jspr_inflight++;
+		r->jspr_queued++;
+	}
+	r->jspr_queued = jsp_uring_submit(&r->jspr_ring, r->jspr_queued);
+}
+
+/*
+ * Waits for a read to complete, and moves `avail` past any chunks that are
+ * now whole. Fails with `err` set if the read did.
+ */
+static int
+jsp_uread_reap(jsp_uread_t *r)
+{
+	uint64_t off;
+	int res;
+	if (jsp_uring_wait(&r->jspr_ring, r->jspr_queued, &off, &res) != 0) {
+		r->jspr_err = errno;
+		return (-1);
+	}
+	r->jspr_queued = 0;
+	r->jspr_inflight--;
+	if (res <= 0) {
+		r->jspr_err = res < 0 ? -res : EIO;
+		return (-1);
+	}
+	/*
+	 * Reads never cross a chunk boundary, so we know where this one was
+	 * meant to end, even if it was itself the remainder of a short read.
+	 */
+	size_t c = off / JSP_URING_CHUNK;
+	size_t want = c * JSP_URING_CHUNK + jsp_uread_chunk(r, off) - off;
+	if ((size_t)res < want) {
+		/* A short read. Queue up the rest of this chunk right away. */
+		jsp_uring_read(&r->jspr_ring, r->jspr_fd, r->jspr_buf,
+		    off + res, want - res);
+		r->jspr_inflight++;
+		r->jspr_queued++;
+	}
+	r->jspr_done[c] += res;
+	while (r->jspr_avail < r->jspr_sz) {
+		c = r->jspr_avail / JSP_URING_CHUNK;
+		size_t len = jsp_uread_chunk(r, r->jspr_avail);
+		if (r->jspr_done[c] != len) {
+			break;
+		}
+		r->jspr_avail += len;
+	}
+	return (0);
+}
+
+/*
+ * The scanner's jsp_fill_t. Keeps the reads going until the prefix that has
+ * landed grows.
+ */
+static int
+jsp_uread_fill(void *arg, size_t *avail)
+{
+	jsp_uread_t *r = arg;
+	size_t was = r->jspr_avail;
+	while (r->jspr_avail == was) {
+		jsp_uread_queue(r);
+		if (r->jspr_inflight == 0) {
+			r->jspr_err = EIO;
+			return (-1);
+		}
+		if (jsp_uread_reap(r) != 0) {
+			return (-1);
+		}
+	}
+	jsp_uread_queue(r);
+	*avail = r->jspr_avail;
+	return (0);
+}
+
+/*
+ * Tearing down the ring doesn't wait for the reads that are still in flight,
+ * so we must reap them before we free the buffer they land in. Reads that
+ * were queued but never submitted go in with the first wait. Returns -1 if we
+ * can't wait, in which case we can't know when the kernel is done with the
+ * buffer.
+ */
+static int
+jsp_uread_drain(jsp_uread_t *r)
+{
+	while (r->jspr_inflight > 0) {
+		uint64_t off;
+		int res;
+		if (jsp_uring_wait(&r->jspr_ring, r->jspr_queued, &off,
+		    &res) != 0) {
+			return (-1);
+		}
+		r->jspr_queued = 0;
+		r->jspr_inflight--;
+	}
+	return (0);
+}
+
+/*
+ * Reads the file into a heap buffer, and parses it as it lands. Returns 1 if
+ * io_uring isn't available, so that the caller can fall back to mmap.
+ */
+static int
+jsp_file_uring(int fd, size_t sz, jsp_ast_t **out)
+{
+	jsp_uread_t r;
+	bzero(&r, sizeof (r));
+	if (jsp_uring_init(&r.jspr_ring) != 0) {
+		return (1);
+	}
+	if (jsp_uring_probe(&r.jspr_ring) != 0) {
+		jsp_uring_fini(&r.jspr_ring);
+		return (1);
+	}
+	r.jspr_fd = fd;
+	r.jspr_sz = sz;
+	r.jspr_buf = malloc(sz);
+	r.jspr_done = calloc((sz + JSP_URING_CHUNK - 1) / JSP_URING_CHUNK,
+	    sizeof (size_t));
+	if (r.jspr_buf == NULL || r.jspr_done == NULL) {
+		jsp_uring_fini(&r.jspr_ring);
+		free(r.jspr_buf);
+		free(r.jspr_done);
+		errno = ENOMEM;
+		return (-1);
+	}
+	jsp_uread_queue(&r);
+	jsp_ast_t *a = jsp_parse_fill(r.jspr_buf, sz, NULL, 0, jsp_uread_fill,
+	    &r);
+	int err = r.jspr_err != 0 ? r.jspr_err : errno;
+	int drained = jsp_uread_drain(&r) == 0;
+	jsp_uring_fini(&r.jspr_ring);
+	free(r.jspr_done);
+	if (a == NULL) {
+		/* If we couldn't drain the ring, we leak the buffer. */
+		if (drained) {
+			free(r.jspr_buf);
+		}
+		errno = err;
+		return (-1);
+	}
+	a->jspa_map = r.jspr_buf;
+	a->jspa_mapsz = sz;
+	a->jspa_mapheap = 1;
+	*out = a;
+	return (0);
+}
+
+#else
+
+static int
+jsp_file_uring(int fd, size_t sz, jsp_ast_t **out)
+{
+	(void) fd;
+	(void) sz;
+	(void) out;
+	return (1);
+}
+
+#endif
+
+void
+jsp_file_release(jsp_ast_t *a)
+{
+	if (a->jspa_map == NULL) {
+		return;
+	}
+	if (a->jspa_mapheap) {
+		free(a->jspa_map);
+	} else {
+		(void) munmap(a->jspa_map, a->jspa_mapsz);
+	}
+	a->jspa_map = NULL;
+}
+
+/*
+ * Parses the file at `path`. Returns NULL, with errno set, if the file can't
+ * be read or doesn't contain well-formed JSON.
+ */
+jsp_ast_t *
+jsp_parse_file(char *path, int flags)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return (NULL);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		(void) close(fd);
+		return (NULL);
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		(void) close(fd);
+		errno = EINVAL;
+		return (NULL);
+	}
+	size_t sz = st.st_size;
+	if (flags & JSP_FILE_URING) {
+		jsp_ast_t *a = NULL;
+		int r = jsp_file_uring(fd, sz, &a);
+		if (r != 1) {
+			int err = errno;
+			(void) close(fd);
+			errno = err;
+			return (a);
+		}
+	}
+	char *data = jsp_file_mmap(fd, sz);
+	int err = errno;
+	(void) close(fd);
+	if (data == NULL) {
+		errno = err;
+		return (NULL);
+	}
+
+	jsp_ast_t *a = jsp_parse(data, sz);
+	if (a == NULL) {
+		err = errno;
+		(void) munmap(data, sz);
+		errno = err;
+		return (NULL);
+	}
+	a->jspa_map = data;
+	a->jspa_mapsz = sz;
+	a->jspa_mapheap = 0;
+	return (a);
+}
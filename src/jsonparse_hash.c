@@ -0,0 +1,168 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include "jsonparse_impl.h"
+
+/*
+ * Structural Hashing
+ * ==================
+ *
+ * jsp_value_hash() hashes the value that a walker is on, such that values
+ * that are equal by jsp_value_equal() hash the same. That means that object
+ * members are combined in an order-independent way (by summing the mixed
+ * hashes of each key and value), while array elements are combined in order,
+ * and numbers are hashed by value, so that 1.0 and 1e0 collide, as they
+ * should. Strings, booleans, and null are hashed by their bytes.
+ *
+ * A node's hash is cached in the node, and stays valid until the value
+ * changes. Every edit dirties the containers above it, which also drops their
+ * hashes, and jsp_reparse() does the same for the containers that enclose
+ * the edit. While a JSON Patch is being applied, we don't cache anything, so
+ * that rolling it back can't leave a stale hash behind. Hashing writes to the
+ * AST, so, like editing, it mustn't race with other uses of the same AST.
+ *
+ * Members with the same key are summed like any others, so reordering them
+ * doesn't change the hash, even though jsp_value_equal() pairs them up by
+ * position. That only makes the hash coarser than equality, which is fine.
+ *
+ * jsp_value_equal() hashes both values, and only does a deep comparison if
+ * the hashes match. The deep comparison, in turn, gives up on any pair of
+ * subtrees whose cached hashes differ. So comparing two documents that
+ * have been hashed costs about as much as finding the parts that are equal.
+ */
+
+#define	JSP_HNUM	0x9e3779b97f4a7c15ULL
+#define	JSP_HSTR	0xc2b2ae3d27d4eb4fULL
+#define	JSP_HLIT	0x165667b19e3779f9ULL
+#define	JSP_HARR	0x27d4eb2f165667c5ULL
+#define	JSP_HOBJ	0xff51afd7ed558ccdULL
+
+/*
+ * The finalizer of SplitMix64; it spreads every input bit over the output.
+ */
+static uint64_t
+jsp_hash_mix(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return (h);
+}
+
+/*
+ * Numbers are equal if they are byte-for-byte identical, or if both are
+ * short enough for jsp_num_equal() to convert, and convert to the same
+ * double. We hash accordingly.
+ */
+static uint64_t
+jsp_hash_num(char *num, size_t len)
+{
+	char b[64];
+	if (len >= sizeof (b)) {
+		return (jsp_hash_bytes(num, len) ^ JSP_HNUM);
+	}
+	bcopy(num, b, len);
+	b[len] = '\0';
+	double d = strtod(b, NULL);
+	if (d == 0) {
+		d = 0;	/* -0 */
+	}
+	uint64_t bits;
+	bcopy(&d, &bits, sizeof (bits));
+	return (jsp_hash_mix(bits ^ JSP_HNUM));
+}
+
+static uint64_t
+jsp_node_hash(jsp_ast_t *a, uint32_t idx)
+{
+	jsp_node_t *n = JSP_NODE(a, idx);
+	if (n->jspn_flags & JSPN_HASHED) {
+		return (n->jspn_hash);
+	}
+	uint64_t h;
+	uint64_t sum;
+	uint32_t cnt = 0;
+	uint32_t c = n->jspn_child;
+	switch (n->jspn_type) {
+	case INTEGER:
+	case FLOAT:
+		h = jsp_hash_num(JSP_VAL(a, idx), n->jspn_len);
+		break;
+	case STRING:
+		h = jsp_hash_mix(jsp_hash_bytes(JSP_VAL(a, idx), n->jspn_len) ^
+		    JSP_HSTR);
+		break;
+	case ARRAY:
+		h = JSP_HARR;
+		while (c != JSP_NONE) {
+			h = jsp_hash_mix(h + jsp_node_hash(a, c));
+			c = JSP_NODE(a, c)->jspn_next;
+		}
+		break;
+	case OBJECT:
+		sum = 0;
+		while (c != JSP_NONE) {
+			jsp_node_t *m = JSP_NODE(a, c);
+			sum += jsp_hash_mix(jsp_hash_bytes(JSP_KEY(a, c),
+			    m->jspn_klen) ^ jsp_hash_mix(jsp_node_hash(a, c)));
+			cnt++;
+			c = m->jspn_next;
+		}
+		h = jsp_hash_mix(sum ^ JSP_HOBJ ^ cnt);
+		break;
+	default:
+		h = jsp_hash_mix(jsp_hash_bytes(JSP_VAL(a, idx), n->jspn_len) ^
+		    JSP_HLIT);
+		break;
+	}
+	if (!a->jspa_jnl_on) {
+		n->jspn_hash = h;
+		n->jspn_flags |= JSPN_HASHED;
+	}
+	return (h);
+}
+
+/*
+ * Returns 0 if the walker is stale.
+ */
+uint64_t
+jsp_value_hash(jsp_ast_t *a, jsp_walk_t *w)
+{
+	uint32_t i = jsp_walk_cur(a, w);
+	if (i == JSP_NONE) {
+		return (0);
+	}
+	return (jsp_node_hash(a, i));
+}
+
+/*
+ * Returns 1 if the values that `w1` and `w2` are on are structurally equal,
+ * in the sense of RFC 6902's "test" operation, and 0 otherwise (or if either
+ * walker is stale). Returns -1, with errno set to ENOMEM, if we ran out of
+ * memory comparing large objects.
+ */
+int
+jsp_value_equal(jsp_ast_t *a1, jsp_walk_t *w1, jsp_ast_t *a2,
+    jsp_walk_t *w2)
+{
+	uint32_t i1 = jsp_walk_cur(a1, w1);
+	uint32_t i2 = jsp_walk_cur(a2, w2);
+	if (i1 == JSP_NONE || i2 == JSP_NONE) {
+		return (0);
+	}
+	if (jsp_node_hash(a1, i1) != jsp_node_hash(a2, i2)) {
+		return (0);
+	}
+	if (a1 == a2 && i1 == i2) {
+		return (1);
+	}
+	return (jsp_node_equal(a1, i1, a2, i2));
+}
@@ -7,23 +7,277 @@
 /*
  * Copyright (c) 2016, Joyent, Inc.
  */
+#ifdef UMEM
 #include <umem.h>
+#endif
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
+#include <string.h>
 #include <strings.h>
+#include <pthread.h>
 #include <graph.h>
 #include <parse.h>
 #include "jsonparse.h"
 
+/*
+ * Index values are 32-bit. JSP_NONE terminates sibling lists and marks the
+ * root's parent, and JSP_NOKEY is the key-id of a node that either isn't an
+ * object member or belongs to a document parsed without a key dictionary.
+ */
+#define	JSP_NONE	UINT32_MAX
+#define	JSP_NOKEY	UINT32_MAX
+#define	JSP_MAX_DEPTH	1024
+
+/*
+ * Index nodes are allocated in chunks of JSP_CHUNK_NODES.
+ */
+#define	JSP_CHUNK_SHIFT	8
+#define	JSP_CHUNK_NODES	(1 << JSP_CHUNK_SHIFT)
+#define	JSP_CHUNK_MASK	(JSP_CHUNK_NODES - 1)
+
+/*
+ * Node flags. A DIRTY node is a container whose children were changed by an
+ * edit, and which therefore can't be reserialized by copying its span. VEDIT
+ * and KEDIT mean that the node's value span, or key span, refer to the AST's
+ * edit buffer instead of the input. A HASHED node's `hash` holds its cached
+ * structural hash. A DEAD node was unlinked from the document (along with
+ * all of its descendants). If it was replaced by jsp_reparse(), its `child`
+ * is the root of the subtree that replaced it.
+ */
+#define	JSPN_DIRTY	0x1
+#define	JSPN_VEDIT	0x2
+#define	JSPN_KEDIT	0x4
+#define	JSPN_HASHED	0x8
+#define	JSPN_DEAD	0x10
+
+/*
+ * The value index. Rather than the libparse AST, we keep a flat array of the
+ * values in the document, in pre-order. Each node records the byte span of
+ * its value within the input, and, if it is an object member, the span of its
+ * key (sans quotes) and the key's dictionary id. This is what the walker
+ * actually walks. `last` is the index of the last node that was added to the
+ * node's subtree when it was scanned. Siblings are doubly linked, and a
+ * container knows its last child (`tail`) as well as its first, so that
+ * edits can link and unlink children without walking the list.
+ */
+typedef struct jsp_node {
+	jsp_type_t	jspn_type;
+	uint32_t	jspn_parent;
+	uint32_t	jspn_child;
+	uint32_t	jspn_tail;
+	uint32_t	jspn_next;
+	uint32_t	jspn_prev;
+	uint32_t	jspn_kid;
+	uint32_t	jspn_klen;
+	uint32_t	jspn_flags;
+	uint32_t	jspn_last;
+	uint64_t	jspn_koff;
+	uint64_t	jspn_off;
+	uint64_t	jspn_len;
+	uint64_t	jspn_hash;
+} jsp_node_t;
+
+/*
+ * While a JSON Patch is being applied, every change to a node's links or flags
+ * is journaled, so that a failed patch can be rolled back.
+ */
+typedef enum jsp_jfield {
+	JSP_JCHILD,
+	JSP_JTAIL,
+	JSP_JNEXT,
+	JSP_JPREV,
+	JSP_JPARENT,
+	JSP_JFLAGS,
+	JSP_JROOT
+} jsp_jfield_t;
+
+typedef struct jsp_jent {
+	uint32_t	jspj_node;
+	jsp_jfield_t	jspj_field;
+	uint32_t	jspj_old;
+} jsp_jent_t;
+
+/*
+ * An entry in the chunk directory. Node offsets are stored relative to the
+ * chunk's `delta`, so that a reparse can shift every node in a chunk that lies
+ * wholly after the edit by adjusting `delta` alone. `min` and `max` bound
+ * the (absolute) value offsets of the chunk's nodes.
+ */
+typedef struct jsp_chunk {
+	jsp_node_t	*jsph_nodes;
+	int64_t		jsph_delta;
+	uint64_t	jsph_min;
+	uint64_t	jsph_max;
+} jsp_chunk_t;
+
+typedef struct jsp_arena jsp_arena_t;
+
+/*
+ * Bitmaps of a 64-byte block of input, one bit per byte, for jsp_validate().
+ * `struct` has the bytes that are one of "{}[]:,", `ctrl` the ones below
+ * 0x20, and `high` the ones above 0x7f.
+ */
+typedef struct jsp_vblk {
+	uint64_t	jspv_quote;
+	uint64_t	jspv_bs;
+	uint64_t	jspv_ws;
+	uint64_t	jspv_struct;
+	uint64_t	jspv_ctrl;
+	uint64_t	jspv_high;
+} jsp_vblk_t;
+
+/*
+ * Waits for more of an input that is still arriving, and sets `*avail` to the
+ * length of the prefix that is now present. Returns -1 if no more of it will
+ * ever arrive.
+ */
+typedef int (*jsp_fill_t)(void *, size_t *);
+
 struct jsp_ast {
-	lp_ast_t *jspa_tree;
+	lp_ast_t	*jspa_tree;
+	char		*jspa_in;
+	size_t		jspa_sz;
+	jsp_keydict_t	*jspa_dict;
+	jsp_chunk_t	*jspa_chunks;
+	uint32_t	jspa_nchunks;
+	uint32_t	jspa_maxchunks;
+	uint32_t	jspa_nnodes;
+	uint32_t	jspa_root;
+	char		*jspa_ebuf;
+	size_t		jspa_esz;
+	size_t		jspa_emax;
+	int		jspa_jnl_on;
+	jsp_jent_t	*jspa_jnl;
+	uint32_t	jspa_njnl;
+	uint32_t	jspa_maxjnl;
+	uint32_t	jspa_ndead;
+	uint32_t	jspa_gen;
+	size_t		jspa_budget;
+	size_t		jspa_used;
+	void		*jspa_map;
+	size_t		jspa_mapsz;
+	int		jspa_mapheap;
+	jsp_arena_t	*jspa_arena;
+	int		jspa_borrowed;
 };
 
+#define	JSP_CHUNK(a, i)	(&(a)->jspa_chunks\
+			[(i) >> JSP_CHUNK_SHIFT])
+#define	JSP_NODE(a, i)	(&JSP_CHUNK(a, i)->jsph_nodes\
+			[(i) & JSP_CHUNK_MASK])
+#define	JSP_DELTA(a, i)	(JSP_CHUNK(a, i)->jsph_delta)
+#define	JSP_OFF(a, i)	(JSP_NODE(a, i)->jspn_off + JSP_DELTA(a, i))
+#define	JSP_KOFF(a, i)	(JSP_NODE(a, i)->jspn_koff +\
+			JSP_DELTA(a, i))
+#define	JSP_BUF(a, i, f)\
+			((JSP_NODE(a, i)->jspn_flags & (f)) ?\
+			(a)->jspa_ebuf : (a)->jspa_in)
+#define	JSP_VAL(a, i)	(JSP_BUF(a, i, JSPN_VEDIT) + JSP_OFF(a, i))
+#define	JSP_KEY(a, i)	(JSP_BUF(a, i, JSPN_KEDIT) + JSP_KOFF(a, i))
+
+/*
+ * An output buffer for serializers. Writes past the end are counted, but
+ * dropped, so that the caller can learn how much room it needs.
+ */
+typedef struct jsp_wbuf {
+	char	*jspb_out;
+	size_t	jspb_sz;
+	size_t	jspb_off;
+} jsp_wbuf_t;
+
+/*
+ * A walker is only good for the generation of the index that it was
+ * positioned in. Rebuilding the index starts a new generation.
+ */
 struct jsp_walk {
 	jsp_ast_t *jspw_tree;
-	lp_ast_node_t *jspw_par_obj;
-	lp_ast_node_t *jspw_cur_key;
-	lp_ast_node_t *jspw_cur_val;
-	char *jspw_key;
-	size_t jspw_key_sz;
+	uint32_t jspw_cur;
+	uint32_t jspw_gen;
+};
+
+/*
+ * The key dictionary. Keys are copied once into append-only string chunks,
+ * and are given dense ids in the order they were first seen. The hash table
+ * is open-addressed, and stores (id + 1), so that 0 marks an empty slot.
+ */
+typedef struct jsp_dkey {
+	char		*jspk_key;
+	size_t		jspk_sz;
+	uint64_t	jspk_hash;
+} jsp_dkey_t;
+
+typedef struct jsp_dchunk {
+	struct jsp_dchunk	*jspc_next;
+	size_t			jspc_used;
+	size_t			jspc_sz;
+	char			jspc_data[];
+} jsp_dchunk_t;
+
+struct jsp_keydict {
+	pthread_rwlock_t	jspd_lock;
+	jsp_dkey_t		*jspd_keys;
+	uint32_t		jspd_nkeys;
+	uint32_t		jspd_maxkeys;
+	uint32_t		*jspd_slots;
+	uint32_t		jspd_nslots;
+	jsp_dchunk_t		*jspd_chunks;
 };
+
+/*
+ * A batch arena. ASTs parsed as part of a batch, and their index nodes, are
+ * carved out of large blocks, which are freed once every AST in the batch has
+ * been destroyed. An AST whose nodes still live in the arena is `borrowed`.
+ */
+typedef struct jsp_ablk {
+	struct jsp_ablk	*jspb_next;
+	size_t		jspb_used;
+	size_t		jspb_sz;
+	char		jspb_data[];
+} jsp_ablk_t;
+
+struct jsp_arena {
+	uint32_t	jspr_refs;
+	jsp_ablk_t	*jspr_blks;
+	jsp_ast_t	*jspr_fill;
+	jsp_chunk_t	*jspr_dir;
+	uint32_t	jspr_maxdir;
+	jsp_ablk_t	*jspr_mblk;
+	size_t		jspr_mused;
+};
+
+int jsp_mem_charge(jsp_ast_t *, size_t);
+void jsp_mem_uncharge(jsp_ast_t *, size_t);
+void *jsp_mem_realloc(jsp_ast_t *, void *, size_t, size_t);
+jsp_ast_t *jsp_ast_alloc(size_t);
+void jsp_ast_free(jsp_ast_t *);
+jsp_walk_t *jsp_walk_alloc();
+void jsp_walk_free(jsp_walk_t *);
+int jsp_chunk_add(jsp_ast_t *);
+void jsp_chunks_free(jsp_ast_t *);
+jsp_arena_t *jsp_arena_create();
+jsp_ast_t *jsp_arena_ast(jsp_arena_t *);
+int jsp_arena_seal(jsp_ast_t *);
+void jsp_arena_discard(jsp_ast_t *);
+int jsp_arena_detach(jsp_ast_t *);
+void jsp_arena_rele(jsp_arena_t *);
+void jsp_arena_done(jsp_arena_t *);
+void jsp_file_release(jsp_ast_t *);
+jsp_ast_t *jsp_parse_fill(char *, size_t, jsp_keydict_t *, size_t,
+    jsp_fill_t, void *);
+uint64_t jsp_hash_bytes(char *, size_t);
+int jsp_keydict_add(jsp_keydict_t *, char *, size_t, uint32_t *,
+    jsp_ast_t *);
+int jsp_index_build(jsp_ast_t *);
+int jsp_index_build_fill(jsp_ast_t *, size_t, jsp_fill_t, void *);
+uint32_t jsp_index_depth(jsp_ast_t *, uint32_t);
+int jsp_index_scan(jsp_ast_t *, char *, size_t, size_t, uint32_t, uint32_t,
+    uint32_t, uint32_t *);
+void jsp_wbuf_put(jsp_wbuf_t *, char *, size_t);
+uint32_t jsp_walk_cur(jsp_ast_t *, jsp_walk_t *);
+int jsp_node_equal(jsp_ast_t *, uint32_t, jsp_ast_t *, uint32_t);
+void jsp_min_classify(char *, jsp_vblk_t *);
+uint64_t jsp_min_escaped(uint64_t, uint64_t *);
+uint64_t jsp_min_pxor(uint64_t);
+void jsp_canon_sort(jsp_ast_t *, uint32_t *, uint32_t *, uint32_t);
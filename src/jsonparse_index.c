@@ -0,0 +1,1289 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include "jsonparse_impl.h"
+
+/*
+ * The Value Index
+ * ===============
+ *
+ * libparse gives us a very fine-grained AST: every character of every string
+ * is a node, and there is no cheap way to get from a node back to the bytes it
+ * covers. That's fine for matching the grammar, but it's a poor fit for
+ * walking a document, which only cares about values, and about where they are
+ * in the input.
+ *
+ * So, instead, we make a single pass over the input with a small
+ * recursive-descent scanner, and record each value in a flat array of
+ * jsp_node_t's, in pre-order. Containers point to their first child, and
+ * children are chained together through their `next` index. An object
+ * member's node also records the span of its key, and, if the document was
+ * parsed against a key dictionary, its key-id.
+ *
+ * Nodes are allocated in fixed-size chunks, and are referred to by their
+ * 32-bit index.
+ *
+ * The same scanner is used to index values that are added to a document by
+ * the edit API, in which case the offsets are relative to the edit buffer,
+ * and the new nodes are flagged accordingly.
+ *
+ * The input doesn't have to be all there when the scan starts. Only the first
+ * `sz` bytes (of `end`) need be present, and whenever the scanner runs out,
+ * it calls `fill` to wait for more, which lets a file be parsed while it is
+ * still being read. Every check against `sz` is one the scanner makes anyway,
+ * so a scan of input that is all present pays nothing for this.
+ */
+
+typedef struct jsp_scan {
+	jsp_ast_t	*jsps_ast;
+	char		*jsps_in;
+	size_t		jsps_sz;
+	size_t		jsps_end;
+	jsp_fill_t	jsps_fill;
+	void		*jsps_arg;
+	size_t		jsps_off;
+	uint32_t	jsps_depth;
+	uint32_t	jsps_flags;
+	jsp_errclass_t	jsps_err;
+	size_t		jsps_eoff;
+} jsp_scan_t;
+
+static int jsp_scan_value(jsp_scan_t *, uint32_t, uint32_t *);
+
+/*
+ * Waits until the first `want` bytes of the input are present, or all of it
+ * is. If the rest of the input will never arrive, we treat the part we have
+ * as all there is, and the scan fails with EOF; the filler knows why.
+ */
+static int
+jsp_scan_more(jsp_scan_t *s, size_t want)
+{
+	while (s->jsps_sz < want && s->jsps_sz < s->jsps_end) {
+		if (s->jsps_fill == NULL ||
+		    s->jsps_fill(s->jsps_arg, &s->jsps_sz) != 0) {
+			s->jsps_end = s->jsps_sz;
+		}
+	}
+	return (s->jsps_sz >= want);
+}
+
+/*
+ * Whether the byte at `i` is present, waiting for it if need be.
+ */
+#define	JSP_SCAN_HAVE(s, i)	\
+	((i) < (s)->jsps_sz || jsp_scan_more((s), (i) + 1))
+
+static uint32_t
+jsp_index_add(jsp_ast_t *a, jsp_type_t t, uint32_t parent, uint64_t off,
+    uint32_t flags)
+{
+	if ((a->jspa_nnodes >> JSP_CHUNK_SHIFT) == a->jspa_nchunks &&
+	    jsp_chunk_add(a) != 0) {
+		return (JSP_NONE);
+	}
+	uint32_t i = a->jspa_nnodes++;
+	jsp_chunk_t *ch = JSP_CHUNK(a, i);
+	jsp_node_t *n = JSP_NODE(a, i);
+	if (off < ch->jsph_min) {
+		ch->jsph_min = off;
+	}
+	if (off > ch->jsph_max) {
+		ch->jsph_max = off;
+	}
+	n->jspn_type = t;
+	n->jspn_parent = parent;
+	n->jspn_child = JSP_NONE;
+	n->jspn_tail = JSP_NONE;
+	n->jspn_next = JSP_NONE;
+	n->jspn_prev = JSP_NONE;
+	n->jspn_kid = JSP_NOKEY;
+	n->jspn_klen = 0;
+	n->jspn_flags = flags;
+	n->jspn_last = i;
+	n->jspn_koff = 0;
+	n->jspn_off = off - ch->jsph_delta;
+	n->jspn_len = 0;
+	n->jspn_hash = 0;
+	return (i);
+}
+
+/*
+ * Records why, and where, the scan failed. Only the first (innermost) error
+ * counts; the callers that unwind from it just return -1.
+ */
+static int
+jsp_scan_err(jsp_scan_t *s, jsp_errclass_t e, size_t off)
+{
+	if (s->jsps_err == JSP_ERR_NONE) {
+		s->jsps_err = e;
+		s->jsps_eoff = off;
+	}
+	return (-1);
+}
+
+/*
+ * Fails with EOF if we've run out of input, and with `e` otherwise.
+ */
+static int
+jsp_scan_err_at(jsp_scan_t *s, jsp_errclass_t e)
+{
+	if (!JSP_SCAN_HAVE(s, s->jsps_off)) {
+		return (jsp_scan_err(s, JSP_ERR_EOF, s->jsps_sz));
+	}
+	return (jsp_scan_err(s, e, s->jsps_off));
+}
+
+static void
+jsp_scan_ws(jsp_scan_t *s)
+{
+	while (JSP_SCAN_HAVE(s, s->jsps_off)) {
+		char c = s->jsps_in[s->jsps_off];
+		if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+			return;
+		}
+		s->jsps_off++;
+	}
+}
+
+static int
+jsp_scan_hex(char c)
+{
+	return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+	    (c >= 'A' && c <= 'F'));
+}
+
+/*
+ * Returns the length of the well-formed UTF-8 sequence (RFC 3629) that starts
+ * at `in[i]`, which is a non-ASCII byte, or 0 if it is ill-formed. Overlong
+ * forms, surrogates, and code points past U+10FFFF are all rejected.
+ */
+static size_t
+jsp_scan_utf8(uint8_t *in, size_t i, size_t sz)
+{
+	uint8_t c = in[i];
+	uint8_t lo = 0x80;
+	uint8_t hi = 0xBF;
+	size_t n;
+	if (c >= 0xC2 && c <= 0xDF) {
+		n = 2;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		n = 3;
+		if (c == 0xE0) {
+			lo = 0xA0;
+		} else if (c == 0xED) {
+			hi = 0x9F;
+		}
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		n = 4;
+		if (c == 0xF0) {
+			lo = 0x90;
+		} else if (c == 0xF4) {
+			hi = 0x8F;
+		}
+	} else {
+		return (0);
+	}
+	if (sz - i < n || in[i + 1] < lo || in[i + 1] > hi) {
+		return (0);
+	}
+	size_t k = 2;
+	while (k < n) {
+		if ((in[i + k] & 0xC0) != 0x80) {
+			return (0);
+		}
+		k++;
+	}
+	return (n);
+}
+
+/*
+ * Most string bytes need no attention at all. We look at them 8 at a time,
+ * and only drop down to a byte at a time when a word holds a quote, a
+ * backslash, a control character, or a non-ASCII byte. These are the
+ * classic "has a zero byte" / "has a byte less than n" bit tricks.
+ */
+#define	JSP_ONES	0x0101010101010101ULL
+#define	JSP_HIGHS	0x8080808080808080ULL
+#define	JSP_HASZERO(w)	(((w) - JSP_ONES) & ~(w) & JSP_HIGHS)
+
+static int
+jsp_scan_plain(char *p)
+{
+	uint64_t w;
+	bcopy(p, &w, sizeof (w));
+	return (((w & JSP_HIGHS) | JSP_HASZERO(w ^ (JSP_ONES * '"')) |
+	    JSP_HASZERO(w ^ (JSP_ONES * '\\')) |
+	    ((w - JSP_ONES * 0x20) & ~w & JSP_HIGHS)) == 0);
+}
+
+/*
+ * Scans a string, starting at its opening quote. On success, `off` and `len`
+ * describe the contents of the string (sans quotes), and the scanner is left
+ * just past the closing quote. The string must be well-formed UTF-8. We keep
+ * 8 bytes of input ahead of us where there are that many, which covers the
+ * longest escape and the longest UTF-8 sequence.
+ */
+static int
+jsp_scan_string(jsp_scan_t *s, uint64_t *off, uint64_t *len)
+{
+	char *in = s->jsps_in;
+	size_t sz = s->jsps_sz;
+	size_t i = s->jsps_off + 1;
+	*off = i;
+	for (;;) {
+		if (sz - i >= 8) {
+			if (jsp_scan_plain(in + i)) {
+				i += 8;
+				continue;
+			}
+		} else if (sz < s->jsps_end) {
+			(void) jsp_scan_more(s, i + 8);
+			sz = s->jsps_sz;
+			continue;
+		} else if (i >= sz) {
+			break;
+		}
+		uint8_t c = in[i];
+		if (c == '"') {
+			*len = i - *off;
+			s->jsps_off = i + 1;
+			return (0);
+		}
+		if (c < 0x20) {
+			return (jsp_scan_err(s, JSP_ERR_STRING, i));
+		}
+		if (c >= 0x80) {
+			size_t n = jsp_scan_utf8((uint8_t *)in, i, sz);
+			if (n == 0) {
+				return (jsp_scan_err(s, JSP_ERR_UTF8, i));
+			}
+			i += n;
+			continue;
+		}
+		if (c != '\\') {
+			i++;
+			continue;
+		}
+		if (i + 1 >= sz) {
+			break;
+		}
+		switch (in[i + 1]) {
+		case '"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			i += 2;
+			break;
+		case 'u':
+			if (i + 6 > sz) {
+				return (jsp_scan_err(s, JSP_ERR_EOF, sz));
+			}
+			if (!jsp_scan_hex(in[i + 2]) ||
+			    !jsp_scan_hex(in[i + 3]) ||
+			    !jsp_scan_hex(in[i + 4]) ||
+			    !jsp_scan_hex(in[i + 5])) {
+				return (jsp_scan_err(s, JSP_ERR_STRING, i));
+			}
+			i += 6;
+			break;
+		default:
+			return (jsp_scan_err(s, JSP_ERR_STRING, i));
+		}
+	}
+	return (jsp_scan_err(s, JSP_ERR_EOF, sz));
+}
+
+static size_t
+jsp_scan_digits(jsp_scan_t *s)
+{
+	size_t start = s->jsps_off;
+	while (JSP_SCAN_HAVE(s, s->jsps_off) &&
+	    s->jsps_in[s->jsps_off] >= '0' && s->jsps_in[s->jsps_off] <= '9') {
+		s->jsps_off++;
+	}
+	return (s->jsps_off - start);
+}
+
+/*
+ * Numbers are scanned according to RFC 8259. A number with a fraction or an
+ * exponent is a FLOAT, everything else is an INTEGER. A zero can't be followed
+ * by more digits; we report that at the zero itself, rather than leaving the
+ * caller to trip over the digits after it.
+ */
+static int
+jsp_scan_number(jsp_scan_t *s, jsp_type_t *t)
+{
+	char *in = s->jsps_in;
+	*t = INTEGER;
+	if (in[s->jsps_off] == '-') {
+		s->jsps_off++;
+	}
+	if (JSP_SCAN_HAVE(s, s->jsps_off) && in[s->jsps_off] == '0') {
+		s->jsps_off++;
+		if (JSP_SCAN_HAVE(s, s->jsps_off) &&
+		    in[s->jsps_off] >= '0' && in[s->jsps_off] <= '9') {
+			return (jsp_scan_err(s, JSP_ERR_NUMBER,
+			    s->jsps_off - 1));
+		}
+	} else if (jsp_scan_digits(s) == 0) {
+		return (jsp_scan_err_at(s, JSP_ERR_NUMBER));
+	}
+	if (JSP_SCAN_HAVE(s, s->jsps_off) && in[s->jsps_off] == '.') {
+		*t = FLOAT;
+		s->jsps_off++;
+		if (jsp_scan_digits(s) == 0) {
+			return (jsp_scan_err_at(s, JSP_ERR_NUMBER));
+		}
+	}
+	if (JSP_SCAN_HAVE(s, s->jsps_off) &&
+	    (in[s->jsps_off] == 'e' || in[s->jsps_off] == 'E')) {
+		*t = FLOAT;
+		s->jsps_off++;
+		if (JSP_SCAN_HAVE(s, s->jsps_off) &&
+		    (in[s->jsps_off] == '+' || in[s->jsps_off] == '-')) {
+			s->jsps_off++;
+		}
+		if (jsp_scan_digits(s) == 0) {
+			return (jsp_scan_err_at(s, JSP_ERR_NUMBER));
+		}
+	}
+	return (0);
+}
+
+static int
+jsp_scan_lit(jsp_scan_t *s, char *lit, size_t sz)
+{
+	size_t i = 0;
+	while (i < sz) {
+		if (!JSP_SCAN_HAVE(s, s->jsps_off + i)) {
+			return (jsp_scan_err(s, JSP_ERR_EOF, s->jsps_sz));
+		}
+		if (s->jsps_in[s->jsps_off + i] != lit[i]) {
+			return (jsp_scan_err(s, JSP_ERR_SYNTAX,
+			    s->jsps_off + i));
+		}
+		i++;
+	}
+	s->jsps_off += sz;
+	return (0);
+}
+
+/*
+ * Scans the members of an object or the elements of an array, starting just
+ * past the opening bracket. Each child is linked to its predecessor as it is
+ * added, and the last one becomes the container's tail.
+ */
+static int
+jsp_scan_children(jsp_scan_t *s, uint32_t par, char close)
+{
+	jsp_ast_t *a = s->jsps_ast;
+	char *in = s->jsps_in;
+	uint32_t prev = JSP_NONE;
+
+	jsp_scan_ws(s);
+	if (JSP_SCAN_HAVE(s, s->jsps_off) && in[s->jsps_off] == close) {
+		s->jsps_off++;
+		return (0);
+	}
+	for (;;) {
+		uint64_t koff = 0;
+		uint64_t klen = 0;
+		uint32_t kid = JSP_NOKEY;
+		uint32_t child;
+
+		if (close == '}') {
+			jsp_scan_ws(s);
+			if (!JSP_SCAN_HAVE(s, s->jsps_off) ||
+			    in[s->jsps_off] != '"') {
+				return (jsp_scan_err_at(s, JSP_ERR_SYNTAX));
+			}
+			if (jsp_scan_string(s, &koff, &klen) != 0) {
+				return (-1);
+			}
+			if (klen > UINT32_MAX) {
+				return (jsp_scan_err(s, JSP_ERR_STRING,
+				    koff - 1));
+			}
+			if (a != NULL && a->jspa_dict != NULL &&
+			    jsp_keydict_add(a->jspa_dict, in + koff, klen,
+			    &kid, a) != 0) {
+				return (-1);
+			}
+			jsp_scan_ws(s);
+			if (!JSP_SCAN_HAVE(s, s->jsps_off) ||
+			    in[s->jsps_off] != ':') {
+				return (jsp_scan_err_at(s, JSP_ERR_SYNTAX));
+			}
+			s->jsps_off++;
+		}
+		if (jsp_scan_value(s, par, &child) != 0) {
+			return (-1);
+		}
+		if (a != NULL) {
+			jsp_node_t *n = JSP_NODE(a, child);
+			n->jspn_koff = koff - JSP_DELTA(a, child);
+			n->jspn_klen = klen;
+			n->jspn_kid = kid;
+			n->jspn_prev = prev;
+			if (prev == JSP_NONE) {
+				JSP_NODE(a, par)->jspn_child = child;
+			} else {
+				JSP_NODE(a, prev)->jspn_next = child;
+			}
+			prev = child;
+		}
+		jsp_scan_ws(s);
+		if (JSP_SCAN_HAVE(s, s->jsps_off) && in[s->jsps_off] == close) {
+			s->jsps_off++;
+			if (a != NULL) {
+				JSP_NODE(a, par)->jspn_tail = prev;
+			}
+			return (0);
+		}
+		if (!JSP_SCAN_HAVE(s, s->jsps_off) || in[s->jsps_off] != ',') {
+			return (jsp_scan_err_at(s, JSP_ERR_SYNTAX));
+		}
+		s->jsps_off++;
+	}
+}
+
+/*
+ * Scans a single value (and any whitespace before it), adding it and all of
+ * its descendants to the index, under the parent `par`.
+ */
+static int
+jsp_scan_value(jsp_scan_t *s, uint32_t par, uint32_t *idx)
+{
+	jsp_ast_t *a = s->jsps_ast;
+	jsp_type_t t;
+	uint64_t off;
+	uint64_t soff;
+	uint64_t slen;
+	int r;
+
+	jsp_scan_ws(s);
+	if (!JSP_SCAN_HAVE(s, s->jsps_off)) {
+		return (jsp_scan_err(s, JSP_ERR_EOF, s->jsps_sz));
+	}
+	off = s->jsps_off;
+	switch (s->jsps_in[off]) {
+	case '{':
+		t = OBJECT;
+		break;
+	case '[':
+		t = ARRAY;
+		break;
+	case '"':
+		t = STRING;
+		break;
+	case 't':
+	case 'f':
+		t = BOOL;
+		break;
+	case 'n':
+		t = NUL;
+		break;
+	case '-':
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		t = INTEGER;
+		break;
+	default:
+		return (jsp_scan_err(s, JSP_ERR_SYNTAX, off));
+	}
+	uint32_t i = JSP_NONE;
+	if (a != NULL) {
+		i = jsp_index_add(a, t, par, off, s->jsps_flags);
+		if (i == JSP_NONE) {
+			return (-1);
+		}
+	}
+	switch (t) {
+	case OBJECT:
+	case ARRAY:
+		if (++s->jsps_depth > JSP_MAX_DEPTH) {
+			return (jsp_scan_err(s, JSP_ERR_DEPTH, off));
+		}
+		s->jsps_off++;
+		r = jsp_scan_children(s, i, t == OBJECT ? '}' : ']');
+		s->jsps_depth--;
+		break;
+	case STRING:
+		r = jsp_scan_string(s, &soff, &slen);
+		break;
+	case BOOL:
+		r = jsp_scan_lit(s, s->jsps_in[off] == 't' ? "true" : "false",
+		    s->jsps_in[off] == 't' ? 4 : 5);
+		break;
+	case NUL:
+		r = jsp_scan_lit(s, "null", 4);
+		break;
+	default:
+		r = jsp_scan_number(s, &t);
+		break;
+	}
+	if (r != 0) {
+		return (-1);
+	}
+	if (a != NULL) {
+		jsp_node_t *n = JSP_NODE(a, i);
+		n->jspn_type = t;
+		n->jspn_last = a->jspa_nnodes - 1;
+		n->jspn_len = s->jsps_off - JSP_OFF(a, i);
+	}
+	*idx = i;
+	return (0);
+}
+
+/*
+ * Scans the single value that makes up the rest of the input, which may only
+ * be followed by whitespace.
+ */
+static int
+jsp_scan_top(jsp_scan_t *s, uint32_t par, uint32_t *idx)
+{
+	if (jsp_scan_value(s, par, idx) != 0) {
+		return (-1);
+	}
+	jsp_scan_ws(s);
+	if (JSP_SCAN_HAVE(s, s->jsps_off)) {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Returns the number of containers that a child of `par` is nested in: `par`
+ * itself, and its ancestors.
+ */
+uint32_t
+jsp_index_depth(jsp_ast_t *a, uint32_t par)
+{
+	uint32_t d = 0;
+	while (par != JSP_NONE) {
+		d++;
+		par = JSP_NODE(a, par)->jspn_parent;
+	}
+	return (d);
+}
+
+/*
+ * Indexes the single JSON value in `in`, between `off` and `end`, as a child
+ * of `par`, and returns the index of its node in `idx`. Every new node gets
+ * `flags`. Only whitespace may surround the value. The value will be nested
+ * in `depth` containers (see jsp_index_depth()), which count towards
+ * JSP_MAX_DEPTH. An AST that borrows its nodes from a batch arena can't grow
+ * in place, so its nodes are copied out first.
+ */
+int
+jsp_index_scan(jsp_ast_t *a, char *in, size_t off, size_t end, uint32_t par,
+    uint32_t depth, uint32_t flags, uint32_t *idx)
+{
+	jsp_scan_t s;
+
+	if (a != NULL && a->jspa_borrowed && jsp_arena_detach(a) != 0) {
+		return (-1);
+	}
+	s.jsps_ast = a;
+	s.jsps_in = in;
+	s.jsps_sz = end;
+	s.jsps_end = end;
+	s.jsps_fill = NULL;
+	s.jsps_arg = NULL;
+	s.jsps_off = off;
+	s.jsps_depth = depth;
+	s.jsps_flags = flags;
+	s.jsps_err = JSP_ERR_NONE;
+	s.jsps_eoff = 0;
+	return (jsp_scan_top(&s, par, idx));
+}
+
+/*
+ * Validation
+ * ==========
+ *
+ * jsp_validate() only answers whether `in` is a single well-formed JSON
+ * value, and, if it isn't, where it first goes wrong. It allocates nothing,
+ * and doesn't touch libparse at all.
+ *
+ * Most input is well-formed, so we first run a fast pass that can only tell
+ * us that it is, and only run the scanner (without an AST) if it can't; the
+ * scanner then says where the input went wrong, if it did. The fast pass
+ * looks at the input 64 bytes at a time, the same way jsp_minify() does (see
+ * jsonparse_minify.c), and finds the strings in each block without looking
+ * at them a byte at a time. Within a block:
+ *
+ *  - control characters, other than whitespace outside of strings, non-ASCII
+ *    bytes outside of strings, and backslashes outside of strings, are all
+ *    errors,
+ *
+ *  - each escaped byte in a string, and each non-ASCII byte that starts a
+ *    sequence, is checked on its own, since they are rare, and
+ *
+ *  - the tokens are the structural characters and opening quotes outside of
+ *    strings, and the first byte of each run of other bytes outside of
+ *    strings (which must be a number or a literal, and which we check with
+ *    the scanner's own routines).
+ *
+ * The tokens go through a small state machine, which keeps the containers
+ * we are in on a stack. Anything it isn't sure about, including input that
+ * nests too deeply, fails the fast pass, and is left to the scanner.
+ */
+
+/*
+ * What the fast pass expects next. VALUE and KEY also allow the container to
+ * end, since they follow its opening bracket; VALUE1 and KEY1 don't.
+ */
+#define	JSP_V_VALUE	0
+#define	JSP_V_VALUE1	1
+#define	JSP_V_KEY	2
+#define	JSP_V_KEY1	3
+#define	JSP_V_COLON	4
+#define	JSP_V_NEXT	5
+#define	JSP_V_DONE	6
+
+/*
+ * Checks the escaped bytes in a string: `e` has their offsets in the block
+ * that starts at `i`.
+ */
+static int
+jsp_valid_escapes(char *in, size_t sz, size_t i, uint64_t e)
+{
+	while (e != 0) {
+		size_t p = i + __builtin_ctzll(e);
+		e &= e - 1;
+		if (p >= sz) {
+			return (-1);
+		}
+		switch (in[p]) {
+		case '"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			break;
+		case 'u':
+			if (p + 4 >= sz || !jsp_scan_hex(in[p + 1]) ||
+			    !jsp_scan_hex(in[p + 2]) ||
+			    !jsp_scan_hex(in[p + 3]) ||
+			    !jsp_scan_hex(in[p + 4])) {
+				return (-1);
+			}
+			break;
+		default:
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+#define	JSP_DIGIT(c)	((unsigned char)((c) - '0') < 10)
+
+static size_t
+jsp_valid_digits(char *in, size_t j, size_t sz)
+{
+	while (j < sz && JSP_DIGIT(in[j])) {
+		j++;
+	}
+	return (j);
+}
+
+/*
+ * Checks the number or literal that starts at `p`, which must be followed by
+ * whitespace, a structural character, or the end of the input, and returns
+ * the offset just past it, or 0 if it's not well-formed. Numbers are common
+ * enough that we check them here, rather than through jsp_scan_number().
+ */
+static size_t
+jsp_valid_atom(jsp_scan_t *s, size_t p)
+{
+	char *in = s->jsps_in;
+	size_t sz = s->jsps_sz;
+	size_t j = p;
+	size_t d;
+	switch (in[p]) {
+	case 't':
+	case 'f':
+	case 'n':
+		s->jsps_off = p;
+		if (jsp_scan_lit(s, in[p] == 't' ? "true" : in[p] == 'f' ?
+		    "false" : "null", in[p] == 'f' ? 5 : 4) != 0) {
+			return (0);
+		}
+		j = s->jsps_off;
+		break;
+	default:
+		if (in[j] == '-') {
+			j++;
+		}
+		if (j < sz && in[j] == '0') {
+			j++;
+		} else if ((d = jsp_valid_digits(in, j, sz)) != j) {
+			j = d;
+		} else {
+			return (0);
+		}
+		if (j < sz && in[j] == '.') {
+			j++;
+			if ((d = jsp_valid_digits(in, j, sz)) == j) {
+				return (0);
+			}
+			j = d;
+		}
+		if (j < sz && (in[j] == 'e' || in[j] == 'E')) {
+			if (++j < sz && (in[j] == '+' || in[j] == '-')) {
+				j++;
+			}
+			if ((d = jsp_valid_digits(in, j, sz)) == j) {
+				return (0);
+			}
+			j = d;
+		}
+		break;
+	}
+	if (j == sz) {
+		return (j);
+	}
+	switch (in[j]) {
+	case ' ':
+	case '\t':
+	case '\n':
+	case '\r':
+	case ',':
+	case ':':
+	case ']':
+	case '}':
+		return (j);
+	default:
+		return (0);
+	}
+}
+
+static int
+jsp_valid_fast(char *in, size_t sz)
+{
+	jsp_scan_t s;
+	char stk[JSP_MAX_DEPTH];
+	uint32_t depth = 0;
+	int st = JSP_V_VALUE1;
+	uint64_t str = 0;
+	uint64_t esc = 0;
+	uint64_t atom = 0;
+	size_t u8 = 0;
+	size_t i;
+
+	bzero(&s, sizeof (s));
+	s.jsps_in = in;
+	s.jsps_sz = sz;
+	s.jsps_end = sz;
+	for (i = 0; i < sz; i += 64) {
+		jsp_vblk_t b;
+		if (sz - i >= 64) {
+			jsp_min_classify(in + i, &b);
+		} else {
+			char last[64];
+			(void) memset(last, ' ', sizeof (last));
+			bcopy(in + i, last, sz - i);
+			jsp_min_classify(last, &b);
+		}
+		uint64_t e = jsp_min_escaped(b.jspv_bs, &esc);
+		uint64_t q = b.jspv_quote & ~e;
+		uint64_t sm = jsp_min_pxor(q) ^ str;
+		str = 0 - (sm >> 63);
+		if (((b.jspv_ctrl & (sm | ~b.jspv_ws)) |
+		    ((b.jspv_high | b.jspv_bs) & ~sm)) != 0) {
+			return (-1);
+		}
+		e &= sm;
+		if (e != 0 && jsp_valid_escapes(in, sz, i, e) != 0) {
+			return (-1);
+		}
+		uint64_t h = b.jspv_high;
+		while (h != 0) {
+			size_t p = i + __builtin_ctzll(h);
+			h &= h - 1;
+			if (p < u8) {
+				continue;
+			}
+			size_t n = jsp_scan_utf8((uint8_t *)in, p, sz);
+			if (n == 0) {
+				return (-1);
+			}
+			u8 = p + n;
+		}
+
+		uint64_t other = ~(b.jspv_ws | b.jspv_struct | sm | q);
+		uint64_t tok = (b.jspv_struct & ~sm) | (q & sm) |
+		    (other & ~((other << 1) | atom));
+		atom = other >> 63;
+		while (tok != 0) {
+			size_t p = i + __builtin_ctzll(tok);
+			tok &= tok - 1;
+			char c = in[p];
+			switch (c) {
+			case '{':
+			case '[':
+				if (st > JSP_V_VALUE1 ||
+				    depth == JSP_MAX_DEPTH) {
+					return (-1);
+				}
+				stk[depth++] = c == '{' ? '}' : ']';
+				st = c == '{' ? JSP_V_KEY : JSP_V_VALUE;
+				continue;
+			case '}':
+			case ']':
+				if ((st != JSP_V_NEXT && st != (c == '}' ?
+				    JSP_V_KEY : JSP_V_VALUE)) ||
+				    depth == 0 || stk[depth - 1] != c) {
+					return (-1);
+				}
+				depth--;
+				break;
+			case ',':
+				if (st != JSP_V_NEXT) {
+					return (-1);
+				}
+				st = stk[depth - 1] == '}' ? JSP_V_KEY1 :
+				    JSP_V_VALUE1;
+				continue;
+			case ':':
+				if (st != JSP_V_COLON) {
+					return (-1);
+				}
+				st = JSP_V_VALUE1;
+				continue;
+			case '"':
+				if (st == JSP_V_KEY || st == JSP_V_KEY1) {
+					st = JSP_V_COLON;
+					continue;
+				}
+				if (st > JSP_V_VALUE1) {
+					return (-1);
+				}
+				break;
+			default:
+				if (st > JSP_V_VALUE1 ||
+				    jsp_valid_atom(&s, p) == 0) {
+					return (-1);
+				}
+				break;
+			}
+			st = depth == 0 ? JSP_V_DONE : JSP_V_NEXT;
+		}
+	}
+	return (st == JSP_V_DONE && str == 0 ? 0 : -1);
+}
+
+/*
+ * Returns 0 if the input is well-formed, and -1 (with `err` filled in, if it
+ * isn't NULL) otherwise. We only count lines once we know where the error
+ * is, so the common, well-formed case pays nothing for it.
+ */
+int
+jsp_validate(char *in, size_t sz, jsp_err_t *err)
+{
+	jsp_scan_t s;
+	uint32_t ignore;
+
+	if (in != NULL && jsp_valid_fast(in, sz) == 0) {
+		if (err != NULL) {
+			bzero(err, sizeof (jsp_err_t));
+		}
+		return (0);
+	}
+
+	s.jsps_ast = NULL;
+	s.jsps_in = in;
+	s.jsps_sz = in == NULL ? 0 : sz;
+	s.jsps_end = s.jsps_sz;
+	s.jsps_fill = NULL;
+	s.jsps_arg = NULL;
+	s.jsps_off = 0;
+	s.jsps_depth = 0;
+	s.jsps_flags = 0;
+	s.jsps_err = JSP_ERR_NONE;
+	s.jsps_eoff = 0;
+	if (jsp_scan_value(&s, JSP_NONE, &ignore) == 0) {
+		jsp_scan_ws(&s);
+		if (!JSP_SCAN_HAVE(&s, s.jsps_off)) {
+			if (err != NULL) {
+				bzero(err, sizeof (jsp_err_t));
+			}
+			return (0);
+		}
+		(void) jsp_scan_err(&s, JSP_ERR_TRAILING, s.jsps_off);
+	}
+	if (err == NULL) {
+		return (-1);
+	}
+	err->jspe_class = s.jsps_err;
+	err->jspe_off = s.jsps_eoff;
+	err->jspe_line = 1;
+	size_t bol = 0;
+	char *nl;
+	while (bol < s.jsps_eoff &&
+	    (nl = memchr(in + bol, '\n', s.jsps_eoff - bol)) != NULL) {
+		err->jspe_line++;
+		bol = nl - in + 1;
+	}
+	err->jspe_col = s.jsps_eoff - bol + 1;
+	return (-1);
+}
+
+/*
+ * Builds the value index for the ast's input. Returns -1 if the input isn't a
+ * single well-formed JSON value (optionally surrounded by whitespace), or if
+ * we ran out of memory.
+ */
+int
+jsp_index_build(jsp_ast_t *a)
+{
+	a->jspa_nnodes = 0;
+	return (jsp_index_scan(a, a->jspa_in, 0, a->jspa_sz, JSP_NONE, 0, 0,
+	    &a->jspa_root));
+}
+
+/*
+ * Like jsp_index_build(), but only the first `avail` bytes of the input are
+ * present yet; `fill` is called to wait for the rest, as the scan needs it.
+ * Returns -1 if `fill` fails before the scan is done.
+ */
+int
+jsp_index_build_fill(jsp_ast_t *a, size_t avail, jsp_fill_t fill, void *arg)
+{
+	jsp_scan_t s;
+
+	a->jspa_nnodes = 0;
+	s.jsps_ast = a;
+	s.jsps_in = a->jspa_in;
+	s.jsps_sz = avail;
+	s.jsps_end = a->jspa_sz;
+	s.jsps_fill = fill;
+	s.jsps_arg = arg;
+	s.jsps_off = 0;
+	s.jsps_depth = 0;
+	s.jsps_flags = 0;
+	s.jsps_err = JSP_ERR_NONE;
+	s.jsps_eoff = 0;
+	if (jsp_scan_top(&s, JSP_NONE, &a->jspa_root) != 0 ||
+	    s.jsps_end != a->jspa_sz) {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Rebuilds the whole index for `in`. The old index is kept until we know that
+ * the new input is well-formed. Both count against the budget in the
+ * meantime.
+ */
+static int
+jsp_index_rebuild(jsp_ast_t *a, char *in, size_t sz)
+{
+	jsp_ast_t t = *a;
+	t.jspa_chunks = NULL;
+	t.jspa_nchunks = 0;
+	t.jspa_maxchunks = 0;
+	t.jspa_in = in;
+	t.jspa_sz = sz;
+	if (jsp_index_build(&t) != 0) {
+		jsp_chunks_free(&t);
+		a->jspa_used = t.jspa_used;
+		return (-1);
+	}
+	size_t used = t.jspa_used - a->jspa_used;
+	jsp_chunks_free(a);
+	a->jspa_chunks = t.jspa_chunks;
+	a->jspa_nchunks = t.jspa_nchunks;
+	a->jspa_maxchunks = t.jspa_maxchunks;
+	a->jspa_nnodes = t.jspa_nnodes;
+	a->jspa_borrowed = t.jspa_borrowed;
+	a->jspa_used += used;
+	a->jspa_root = t.jspa_root;
+	a->jspa_ndead = 0;
+	a->jspa_gen++;
+	return (0);
+}
+
+/*
+ * Returns the live node with the greatest offset below `off`, or JSP_NONE.
+ *
+ * The nodes that one scan adds are in pre-order, and so sorted by offset. We
+ * binary search the first scan's nodes, and if the node we land on is dead,
+ * we move on to the nodes of the scan that replaced it. The nodes of a dead
+ * subtree are all moved to its offset (see jsp_index_bury()), so that this
+ * doesn't upset the order.
+ */
+static uint32_t
+jsp_index_before(jsp_ast_t *a, uint64_t off)
+{
+	uint32_t base = 0;
+	for (;;) {
+		uint32_t lo = base;
+		uint32_t hi = JSP_NODE(a, base)->jspn_last + 1;
+		if (JSP_OFF(a, base) >= off) {
+			return (JSP_NONE);
+		}
+		while (hi - lo > 1) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (JSP_OFF(a, mid) < off) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		uint32_t c = lo;
+		while (c != JSP_NONE &&
+		    !(JSP_NODE(a, c)->jspn_flags & JSPN_DEAD)) {
+			c = JSP_NODE(a, c)->jspn_parent;
+		}
+		if (c == JSP_NONE) {
+			return (lo);
+		}
+
+		/*
+		 * If the replacement has since been replaced too, skip ahead,
+		 * so that repeated edits in one place don't make a long chain.
+		 */
+		jsp_node_t *n = JSP_NODE(a, c);
+		base = n->jspn_child;
+		while (JSP_NODE(a, base)->jspn_flags & JSPN_DEAD) {
+			base = JSP_NODE(a, base)->jspn_child;
+		}
+		n->jspn_child = base;
+	}
+}
+
+/*
+ * Moves the nodes that were scanned as part of `t` to `off`, along with the
+ * subtrees that replaced any of them.
+ */
+static void
+jsp_index_bury(jsp_ast_t *a, uint32_t t, uint64_t off)
+{
+	uint32_t last = JSP_NODE(a, t)->jspn_last;
+	uint32_t i = t;
+	while (i <= last) {
+		jsp_chunk_t *ch = JSP_CHUNK(a, i);
+		jsp_node_t *n = JSP_NODE(a, i);
+		n->jspn_off = off - ch->jsph_delta;
+		if (off < ch->jsph_min) {
+			ch->jsph_min = off;
+		}
+		if (n->jspn_flags & JSPN_DEAD) {
+			jsp_index_bury(a, n->jspn_child, off);
+		}
+		i++;
+	}
+}
+
+static uint32_t
+jsp_index_count(jsp_ast_t *a, uint32_t idx)
+{
+	uint32_t n = 1;
+	uint32_t c = JSP_NODE(a, idx)->jspn_child;
+	while (c != JSP_NONE) {
+		n += jsp_index_count(a, c);
+		c = JSP_NODE(a, c)->jspn_next;
+	}
+	return (n);
+}
+
+/*
+ * Adds `delta` to the offsets (at or past `end`) of the nodes below `mark`.
+ * Chunks that lie wholly before `end` are skipped, and the ones that lie
+ * wholly past it are shifted by adjusting their delta; only the ones that
+ * straddle it are visited node by node.
+ */
+static void
+jsp_index_shift(jsp_ast_t *a, uint32_t mark, uint64_t end, int64_t delta)
+{
+	uint32_t k = 0;
+	while (((uint64_t)k << JSP_CHUNK_SHIFT) < mark) {
+		jsp_chunk_t *ch = &a->jspa_chunks[k];
+		uint32_t i = k << JSP_CHUNK_SHIFT;
+		uint32_t last = i + JSP_CHUNK_NODES;
+		k++;
+		if (ch->jsph_max < end) {
+			continue;
+		}
+		if (last <= mark && ch->jsph_min >= end) {
+			ch->jsph_delta += delta;
+			ch->jsph_min += delta;
+			ch->jsph_max += delta;
+			continue;
+		}
+		uint64_t min = UINT64_MAX;
+		uint64_t max = 0;
+		while (i < last && i < a->jspa_nnodes) {
+			jsp_node_t *n = JSP_NODE(a, i);
+			if (i < mark && JSP_OFF(a, i) >= end) {
+				n->jspn_off += delta;
+			}
+			if (i < mark && n->jspn_klen != 0 &&
+			    JSP_KOFF(a, i) >= end) {
+				n->jspn_koff += delta;
+			}
+			if (JSP_OFF(a, i) < min) {
+				min = JSP_OFF(a, i);
+			}
+			if (JSP_OFF(a, i) > max) {
+				max = JSP_OFF(a, i);
+			}
+			i++;
+		}
+		ch->jsph_min = min;
+		ch->jsph_max = max;
+	}
+}
+
+/*
+ * Incremental Re-parsing
+ * ======================
+ *
+ * When the input changes by a small, localized edit, we don't want to index
+ * the whole thing again. The caller tells us that the `old_len` bytes at
+ * `edit_off` were replaced by `new_len` bytes, giving `new_in`. We find the
+ * smallest object or array that strictly encloses the edited bytes (that is,
+ * the edit doesn't touch its brackets), by searching for the last node
+ * before the edit and walking up from there. We re-scan only that container
+ * in the new input, and splice the new subtree in where the old one was.
+ * Every other node is reused as is, and only has its offsets shifted if it
+ * comes after the edit. The nodes of the old subtree are left dead in the
+ * array, and once there are more dead nodes than live ones we compact by
+ * rebuilding.
+ *
+ * If the edit touches the root's brackets, or the container no longer scans
+ * (because the edit unbalanced it, say), we fall back to indexing the whole
+ * input. If that fails too, the new input isn't well-formed, we return -1,
+ * and the AST is left as it was.
+ *
+ * Nodes that come after the edit are shifted a chunk at a time, by way of the
+ * chunk's delta, so the cost of a re-parse is in the size of the edited
+ * container and the depth of the document, not the size of the index.
+ *
+ * The libparse tree can't be updated incrementally, so it is discarded (once
+ * the new input has been indexed successfully). A
+ * document that has been edited through the edit API can't be re-parsed.
+ * Walkers that were positioned inside the re-scanned subtree (or anywhere, if
+ * we had to rebuild the index) go stale, and must be reset.
+ */
+int
+jsp_reparse(jsp_ast_t *a, char *new_in, size_t new_sz, size_t edit_off,
+    size_t old_len, size_t new_len)
+{
+	if (new_in == NULL || a->jspa_esz != 0 ||
+	    (JSP_NODE(a, a->jspa_root)->jspn_flags & JSPN_DIRTY) ||
+	    edit_off + old_len > a->jspa_sz ||
+	    new_sz != a->jspa_sz - old_len + new_len) {
+		return (-1);
+	}
+
+	uint64_t end = edit_off + old_len;
+	int64_t delta = (int64_t)new_len - (int64_t)old_len;
+	uint32_t t = JSP_NONE;
+	uint32_t c = jsp_index_before(a, edit_off);
+	while (c != JSP_NONE) {
+		jsp_node_t *n = JSP_NODE(a, c);
+		if (end < JSP_OFF(a, c) + n->jspn_len &&
+		    (n->jspn_type == OBJECT || n->jspn_type == ARRAY)) {
+			t = c;
+			break;
+		}
+		c = n->jspn_parent;
+	}
+	if (t == JSP_NONE || a->jspa_ndead > a->jspa_nnodes / 2) {
+		goto rebuild;
+	}
+
+	jsp_node_t *tn = JSP_NODE(a, t);
+	uint32_t mark = a->jspa_nnodes;
+	uint32_t par = tn->jspn_parent;
+	uint64_t toff = JSP_OFF(a, t);
+	uint64_t tend = toff + tn->jspn_len + delta;
+	uint32_t new;
+	if (jsp_index_scan(a, new_in, toff, tend, par, jsp_index_depth(a, par),
+	    0, &new) != 0) {
+		a->jspa_nnodes = mark;
+		goto rebuild;
+	}
+
+	/*
+	 * Splice the new subtree in. Its key (if any) precedes the edit, so it
+	 * doesn't move.
+	 */
+	tn = JSP_NODE(a, t);
+	jsp_node_t *nn = JSP_NODE(a, new);
+	nn->jspn_koff = JSP_KOFF(a, t) - JSP_DELTA(a, new);
+	nn->jspn_klen = tn->jspn_klen;
+	nn->jspn_kid = tn->jspn_kid;
+	nn->jspn_next = tn->jspn_next;
+	nn->jspn_prev = tn->jspn_prev;
+	if (par == JSP_NONE) {
+		a->jspa_root = new;
+	} else {
+		jsp_node_t *pn = JSP_NODE(a, par);
+		if (tn->jspn_prev == JSP_NONE) {
+			pn->jspn_child = new;
+		} else {
+			JSP_NODE(a, tn->jspn_prev)->jspn_next = new;
+		}
+		if (tn->jspn_next == JSP_NONE) {
+			pn->jspn_tail = new;
+		} else {
+			JSP_NODE(a, tn->jspn_next)->jspn_prev = new;
+		}
+	}
+	a->jspa_ndead += jsp_index_count(a, t);
+	jsp_index_bury(a, t, toff);
+	tn = JSP_NODE(a, t);
+	tn->jspn_flags |= JSPN_DEAD;
+	tn->jspn_child = new;
+
+	/*
+	 * Shift everything that comes after the edit, and grow (or shrink) the
+	 * ancestors that enclose it. The new subtree is already in place, so
+	 * only the chunks below `mark` are shifted.
+	 */
+	jsp_index_shift(a, mark, end, delta);
+	while (par != JSP_NONE) {
+		JSP_NODE(a, par)->jspn_len += delta;
+		JSP_NODE(a, par)->jspn_flags &= ~JSPN_HASHED;
+		par = JSP_NODE(a, par)->jspn_parent;
+	}
+	goto done;
+
+rebuild:
+	if (jsp_index_rebuild(a, new_in, new_sz) != 0) {
+		return (-1);
+	}
+done:
+	if (a->jspa_tree != NULL) {
+		lp_destroy_ast(a->jspa_tree);
+		a->jspa_tree = NULL;
+	}
+	a->jspa_in = new_in;
+	a->jspa_sz = new_sz;
+	return (0);
+}
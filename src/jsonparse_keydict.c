@@ -0,0 +1,289 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include "jsonparse_impl.h"
+
+/*
+ * Key Dictionary
+ * ==============
+ *
+ * A stream of JSON records tends to repeat the same handful of keys over and
+ * over again. The key dictionary maps each distinct key to a small integer id,
+ * and can be shared by any number of parses (and threads). A document parsed
+ * against a dictionary records the id of each member's key in its value
+ * index, so that walking to a member is a matter of comparing integers,
+ * instead of comparing bytes.
+ *
+ * The dictionary is read-mostly: once the working set of keys has been seen,
+ * every parse only ever takes the read-lock. Keys are never removed, so ids
+ * and the key pointers returned by jsp_keydict_key() remain valid until the
+ * dictionary itself is destroyed.
+ *
+ * Keys are compared as raw bytes, exactly as they appear between the quotes
+ * in the input. Escape sequences are not decoded, so "\u0061" and "a" are two
+ * different keys.
+ *
+ * The dictionary outlives the parses that fill it, but a parse with a memory
+ * budget is still charged for each key that it adds (see JSP_DKEY_COST), so
+ * that a budget bounds what a hostile document can make us allocate. The
+ * charge is never given back, since the key stays.
+ */
+
+#define	JSP_DCHUNK_SZ	(64 * 1024)
+#define	JSP_DSLOTS_MIN	64
+
+/*
+ * What adding a key costs: its bytes, its entry in the (doubling) key array,
+ * and its slots in the table, which is kept between a quarter and half full.
+ */
+#define	JSP_DKEY_COST(sz)	((sz) + 2 * sizeof (jsp_dkey_t) +\
+				4 * sizeof (uint32_t))
+
+/*
+ * This is the 64-bit FNV-1a hash. It's not the fastest hash around, but keys
+ * are short, and it's good enough for a table that is mostly hit.
+ */
+uint64_t
+jsp_hash_bytes(char *b, size_t sz)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	while (i < sz) {
+		h ^= (uint8_t)b[i];
+		h *= 0x100000001b3ULL;
+		i++;
+	}
+	return (h);
+}
+
+jsp_keydict_t *
+jsp_keydict_create()
+{
+	jsp_keydict_t *d = calloc(1, sizeof (jsp_keydict_t));
+	if (d == NULL) {
+		return (NULL);
+	}
+	d->jspd_slots = calloc(JSP_DSLOTS_MIN, sizeof (uint32_t));
+	if (d->jspd_slots == NULL) {
+		free(d);
+		return (NULL);
+	}
+	d->jspd_nslots = JSP_DSLOTS_MIN;
+	(void) pthread_rwlock_init(&d->jspd_lock, NULL);
+	return (d);
+}
+
+void
+jsp_keydict_destroy(jsp_keydict_t *d)
+{
+	jsp_dchunk_t *c = d->jspd_chunks;
+	while (c != NULL) {
+		jsp_dchunk_t *n = c->jspc_next;
+		free(c);
+		c = n;
+	}
+	(void) pthread_rwlock_destroy(&d->jspd_lock);
+	free(d->jspd_slots);
+	free(d->jspd_keys);
+	free(d);
+}
+
+/*
+ * Returns the id of the key, or JSP_NOKEY. The caller must hold the lock
+ * (either way).
+ */
+static uint32_t
+jsp_keydict_find(jsp_keydict_t *d, char *key, size_t sz, uint64_t h)
+{
+	uint32_t mask = d->jspd_nslots - 1;
+	uint32_t s = h & mask;
+	while (d->jspd_slots[s] != 0) {
+		jsp_dkey_t *k = &d->jspd_keys[d->jspd_slots[s] - 1];
+		if (k->jspk_hash == h && k->jspk_sz == sz &&
+		    memcmp(k->jspk_key, key, sz) == 0) {
+			return (d->jspd_slots[s] - 1);
+		}
+		s = (s + 1) & mask;
+	}
+	return (JSP_NOKEY);
+}
+
+/*
+ * We keep the table at most half-full. When growing, we just rehash from the
+ * key array, since it already has all of the hashes.
+ */
+static int
+jsp_keydict_grow(jsp_keydict_t *d)
+{
+	uint32_t nslots = d->jspd_nslots * 2;
+	uint32_t *slots = calloc(nslots, sizeof (uint32_t));
+	if (slots == NULL) {
+		return (-1);
+	}
+	uint32_t i = 0;
+	while (i < d->jspd_nkeys) {
+		uint32_t s = d->jspd_keys[i].jspk_hash & (nslots - 1);
+		while (slots[s] != 0) {
+			s = (s + 1) & (nslots - 1);
+		}
+		slots[s] = i + 1;
+		i++;
+	}
+	free(d->jspd_slots);
+	d->jspd_slots = slots;
+	d->jspd_nslots = nslots;
+	return (0);
+}
+
+static char *
+jsp_keydict_copy(jsp_keydict_t *d, char *key, size_t sz)
+{
+	jsp_dchunk_t *c = d->jspd_chunks;
+	if (c == NULL || c->jspc_sz - c->jspc_used < sz) {
+		size_t csz = sz > JSP_DCHUNK_SZ ? sz : JSP_DCHUNK_SZ;
+		c = malloc(sizeof (jsp_dchunk_t) + csz);
+		if (c == NULL) {
+			return (NULL);
+		}
+		c->jspc_used = 0;
+		c->jspc_sz = csz;
+		c->jspc_next = d->jspd_chunks;
+		d->jspd_chunks = c;
+	}
+	char *p = c->jspc_data + c->jspc_used;
+	bcopy(key, p, sz);
+	c->jspc_used += sz;
+	return (p);
+}
+
+/*
+ * Looks up the key without adding it. Returns 0 and sets `id` if found, -1
+ * otherwise.
+ */
+int
+jsp_keydict_lookup(jsp_keydict_t *d, char *key, size_t sz, uint32_t *id)
+{
+	uint64_t h = jsp_hash_bytes(key, sz);
+	(void) pthread_rwlock_rdlock(&d->jspd_lock);
+	uint32_t k = jsp_keydict_find(d, key, sz, h);
+	(void) pthread_rwlock_unlock(&d->jspd_lock);
+	if (k == JSP_NOKEY) {
+		return (-1);
+	}
+	*id = k;
+	return (0);
+}
+
+/*
+ * Looks up the key, adding it if it isn't there yet. The common case is that
+ * the key is already there, so we try under the read-lock first, and only
+ * take the write-lock if we have to add it (checking again, since some other
+ * thread may have beaten us to it). If `a` is not NULL, adding the key is
+ * charged against its budget.
+ */
+int
+jsp_keydict_add(jsp_keydict_t *d, char *key, size_t sz, uint32_t *id,
+    jsp_ast_t *a)
+{
+	uint64_t h = jsp_hash_bytes(key, sz);
+	size_t cost = 0;
+	(void) pthread_rwlock_rdlock(&d->jspd_lock);
+	uint32_t k = jsp_keydict_find(d, key, sz, h);
+	(void) pthread_rwlock_unlock(&d->jspd_lock);
+	if (k != JSP_NOKEY) {
+		*id = k;
+		return (0);
+	}
+
+	(void) pthread_rwlock_wrlock(&d->jspd_lock);
+	k = jsp_keydict_find(d, key, sz, h);
+	if (k != JSP_NOKEY) {
+		goto out;
+	}
+	if (d->jspd_nkeys == JSP_NOKEY - 1) {
+		goto fail;
+	}
+	if (a != NULL) {
+		if (jsp_mem_charge(a, JSP_DKEY_COST(sz)) != 0) {
+			goto fail;
+		}
+		cost = JSP_DKEY_COST(sz);
+	}
+	if ((d->jspd_nkeys + 1) * 2 > d->jspd_nslots &&
+	    jsp_keydict_grow(d) != 0) {
+		goto fail;
+	}
+	if (d->jspd_nkeys == d->jspd_maxkeys) {
+		uint32_t max = d->jspd_maxkeys ? d->jspd_maxkeys * 2 : 32;
+		jsp_dkey_t *keys = realloc(d->jspd_keys,
+		    max * sizeof (jsp_dkey_t));
+		if (keys == NULL) {
+			goto fail;
+		}
+		d->jspd_keys = keys;
+		d->jspd_maxkeys = max;
+	}
+	char *copy = jsp_keydict_copy(d, key, sz);
+	if (copy == NULL) {
+		goto fail;
+	}
+	k = d->jspd_nkeys;
+	d->jspd_keys[k].jspk_key = copy;
+	d->jspd_keys[k].jspk_sz = sz;
+	d->jspd_keys[k].jspk_hash = h;
+	d->jspd_nkeys++;
+
+	uint32_t s = h & (d->jspd_nslots - 1);
+	while (d->jspd_slots[s] != 0) {
+		s = (s + 1) & (d->jspd_nslots - 1);
+	}
+	d->jspd_slots[s] = k + 1;
+out:
+	(void) pthread_rwlock_unlock(&d->jspd_lock);
+	*id = k;
+	return (0);
+fail:
+	(void) pthread_rwlock_unlock(&d->jspd_lock);
+	if (cost != 0) {
+		jsp_mem_uncharge(a, cost);
+	}
+	return (-1);
+}
+
+int
+jsp_keydict_intern(jsp_keydict_t *d, char *key, size_t sz, uint32_t *id)
+{
+	return (jsp_keydict_add(d, key, sz, id, NULL));
+}
+
+/*
+ * Returns the bytes of the key with the given id, or NULL if there is no such
+ * key.
+ */
+char *
+jsp_keydict_key(jsp_keydict_t *d, uint32_t id, size_t *sz)
+{
+	char *key = NULL;
+	(void) pthread_rwlock_rdlock(&d->jspd_lock);
+	if (id < d->jspd_nkeys) {
+		key = d->jspd_keys[id].jspk_key;
+		*sz = d->jspd_keys[id].jspk_sz;
+	}
+	(void) pthread_rwlock_unlock(&d->jspd_lock);
+	return (key);
+}
+
+size_t
+jsp_keydict_count(jsp_keydict_t *d)
+{
+	(void) pthread_rwlock_rdlock(&d->jspd_lock);
+	size_t n = d->jspd_nkeys;
+	(void) pthread_rwlock_unlock(&d->jspd_lock);
+	return (n);
+}
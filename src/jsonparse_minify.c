@@ -0,0 +1,715 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include <stdio.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+#include "jsonparse_impl.h"
+
+/*
+ * Minifying
+ * =========
+ *
+ * jsp_minify() strips the insignificant whitespace out of a JSON text. The
+ * only thing it has to know about JSON is where strings begin and end, since
+ * whitespace inside of them is significant; it doesn't otherwise check that
+ * the input is well-formed (use jsp_validate() for that).
+ *
+ * We look at the input 64 bytes at a time, and first build bitmaps of where
+ * the block's quotes, backslashes, and whitespace are: with SSE2 compares,
+ * or, elsewhere, with the same SWAR tricks as the string scanner. Which bytes
+ * are inside of strings then falls out of the bitmaps, without a branch per
+ * byte:
+ *
+ *  - A byte is escaped if it follows an odd-length run of backslashes.
+ *    jsp_min_escaped() finds these by adding the starts of the runs to the
+ *    runs themselves, and looking at where the carries land.
+ *
+ *  - Every unescaped quote toggles whether we are in a string, so the
+ *    prefix-XOR of those quotes (a carry-less multiply by all ones, if we
+ *    have PCLMUL) has the bytes from each opening quote up to its closing
+ *    quote set.
+ *
+ * Whether the block ended inside a string (or right after a backslash) is
+ * carried into the next one. Whitespace outside of strings is dropped, and
+ * the rest of the block is compacted into `out`: with SSSE3, 8 bytes at a
+ * time, by a shuffle looked up in `jsp_min_shuf`; elsewhere, 8 bytes at a
+ * time if none of them are dropped, and a byte at a time if some are. The
+ * last partial block is filtered a byte at a time.
+ *
+ * The output is never longer than the input, and never gets ahead of it, so
+ * `out` may be `in`, to minify in place. The SSSE3 path writes 8 bytes at a
+ * time past the end of what it keeps, but never past the end of the block,
+ * which has already been loaded.
+ *
+ * jsp_validate() finds strings the same way, and jsp_min_classify() loads a
+ * block for it, with bitmaps of the bytes it needs besides: the structural
+ * characters, control characters, and non-ASCII bytes.
+ */
+
+#define	JSP_MIN_STR	0x1
+#define	JSP_MIN_ESC	0x2
+
+#define	JSP_MIN_BLK	64
+
+typedef struct jsp_min_blk {
+#ifdef __SSE2__
+	__m128i		jspk_v[4];
+#endif
+	uint64_t	jspk_quote;
+	uint64_t	jspk_bs;
+	uint64_t	jspk_ws;
+} jsp_min_blk_t;
+
+#ifdef __SSE2__
+
+static void
+jsp_min_load(char *p, jsp_min_blk_t *b)
+{
+	int k;
+	b->jspk_quote = b->jspk_bs = b->jspk_ws = 0;
+	for (k = 0; k < 4; k++) {
+		__m128i v = _mm_loadu_si128((__m128i *)(p + 16 * k));
+		__m128i w = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+		b->jspk_v[k] = v;
+		b->jspk_quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << (16 * k);
+		b->jspk_bs |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << (16 * k);
+		b->jspk_ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(w) <<
+		    (16 * k);
+	}
+}
+
+void
+jsp_min_classify(char *p, jsp_vblk_t *b)
+{
+	int k;
+	bzero(b, sizeof (*b));
+	for (k = 0; k < 4; k++) {
+		__m128i v = _mm_loadu_si128((__m128i *)(p + 16 * k));
+		__m128i w = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+		__m128i st = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))));
+		st = _mm_or_si128(st,
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+		/* Bytes past 0x7f are negative, so they aren't below ' '. */
+		__m128i c = _mm_and_si128(_mm_cmplt_epi8(v,
+		    _mm_set1_epi8(' ')), _mm_cmpgt_epi8(v, _mm_set1_epi8(-1)));
+		b->jspv_quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << (16 * k);
+		b->jspv_bs |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << (16 * k);
+		b->jspv_ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(w) <<
+		    (16 * k);
+		b->jspv_struct |= (uint64_t)(uint16_t)_mm_movemask_epi8(st) <<
+		    (16 * k);
+		b->jspv_ctrl |= (uint64_t)(uint16_t)_mm_movemask_epi8(c) <<
+		    (16 * k);
+		b->jspv_high |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) <<
+		    (16 * k);
+	}
+}
+
+#else
+
+#define	JSP_ONES	0x0101010101010101ULL
+#define	JSP_LOWS	0x7f7f7f7f7f7f7f7fULL
+
+/*
+ * Sets the high bit of each byte of `w` that is equal to `c`. Unlike the
+ * cheaper test the string scanner uses, this one is exact, since we need to
+ * know which bytes matched, not just whether any did.
+ */
+#define	JSP_EQ(w, c)	(~(((((w) ^ (JSP_ONES * (c))) & JSP_LOWS) +\
+			JSP_LOWS) | ((w) ^ (JSP_ONES * (c))) | JSP_LOWS))
+
+/*
+ * Gathers the high bits of the bytes of `h` into a byte.
+ */
+#define	JSP_BITS(h)	((((h) >> 7) * 0x0102040810204080ULL) >> 56)
+
+static void
+jsp_min_load(char *p, jsp_min_blk_t *b)
+{
+	int k;
+	b->jspk_quote = b->jspk_bs = b->jspk_ws = 0;
+	for (k = 0; k < 8; k++) {
+		uint64_t w;
+		bcopy(p + 8 * k, &w, sizeof (w));
+		b->jspk_quote |= JSP_BITS(JSP_EQ(w, '"')) << (8 * k);
+		b->jspk_bs |= JSP_BITS(JSP_EQ(w, '\\')) << (8 * k);
+		b->jspk_ws |= JSP_BITS(JSP_EQ(w, ' ') | JSP_EQ(w, '\t') |
+		    JSP_EQ(w, '\n') | JSP_EQ(w, '\r')) << (8 * k);
+	}
+}
+
+void
+jsp_min_classify(char *p, jsp_vblk_t *b)
+{
+	int k;
+	bzero(b, sizeof (*b));
+	for (k = 0; k < 8; k++) {
+		uint64_t w;
+		bcopy(p + 8 * k, &w, sizeof (w));
+		uint64_t h = w & ~JSP_LOWS;
+		/* Adding 0x60 to any other byte under 0x80 sets its top bit. */
+		uint64_t c = ~(((w & JSP_LOWS) + JSP_ONES * 0x60) | w) &
+		    ~JSP_LOWS;
+		b->jspv_quote |= JSP_BITS(JSP_EQ(w, '"')) << (8 * k);
+		b->jspv_bs |= JSP_BITS(JSP_EQ(w, '\\')) << (8 * k);
+		b->jspv_ws |= JSP_BITS(JSP_EQ(w, ' ') | JSP_EQ(w, '\t') |
+		    JSP_EQ(w, '\n') | JSP_EQ(w, '\r')) << (8 * k);
+		b->jspv_struct |= JSP_BITS(JSP_EQ(w, '{') | JSP_EQ(w, '}') |
+		    JSP_EQ(w, '[') | JSP_EQ(w, ']') | JSP_EQ(w, ':') |
+		    JSP_EQ(w, ',')) << (8 * k);
+		b->jspv_ctrl |= JSP_BITS(c) << (8 * k);
+		b->jspv_high |= JSP_BITS(h) << (8 * k);
+	}
+}
+
+#endif
+
+/*
+ * Returns the bytes in the block that are escaped, given its backslashes.
+ * `esc` says whether the first byte is escaped by the end of the previous
+ * block, and is set to whether the first byte of the next block will be.
+ */
+uint64_t
+jsp_min_escaped(uint64_t bs, uint64_t *esc)
+{
+	uint64_t even = 0x5555555555555555ULL;
+	uint64_t escaped = *esc;
+	bs &= ~escaped;
+	uint64_t follows = (bs << 1) | escaped;
+	/*
+	 * A byte after a run of backslashes is escaped if the run began on
+	 * a byte of the other parity. Adding the starts of the runs that
+	 * begin on odd bytes to the runs clears those runs (carrying out of
+	 * the block if one reaches the end), so that `even ^ seq << 1` picks
+	 * odd bytes after the runs that begin on even bytes, and even bytes
+	 * after the rest.
+	 */
+	uint64_t odd = bs & ~even & ~follows;
+	uint64_t seq = odd + bs;
+	*esc = seq < odd;
+	return ((even ^ (seq << 1)) & follows);
+}
+
+uint64_t
+jsp_min_pxor(uint64_t x)
+{
+#ifdef __PCLMUL__
+	return ((uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(
+	    _mm_set_epi64x(0, (int64_t)x), _mm_set1_epi8(-1), 0)));
+#else
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return (x);
+#endif
+}
+
+#ifdef __SSSE3__
+
+static size_t
+jsp_min_popc8(uint64_t m)
+{
+	m = m - ((m >> 1) & 0x55);
+	m = (m & 0x33) + ((m >> 2) & 0x33);
+	return ((m + (m >> 4)) & 0x0f);
+}
+
+/*
+ * For each set of bytes to keep out of 8, the shuffle that moves them to the
+ * front. The rest of the lanes are zeroed.
+ */
+static const uint64_t jsp_min_shuf[256] = {
+	0x8080808080808080ULL, 0x8080808080808000ULL, 0x8080808080808001ULL,
+	0x8080808080800100ULL, 0x8080808080808002ULL, 0x8080808080800200ULL,
+	0x8080808080800201ULL, 0x8080808080020100ULL, 0x8080808080808003ULL,
+	0x8080808080800300ULL, 0x8080808080800301ULL, 0x8080808080030100ULL,
+	0x8080808080800302ULL, 0x8080808080030200ULL, 0x8080808080030201ULL,
+	0x8080808003020100ULL, 0x8080808080808004ULL, 0x8080808080800400ULL,
+	0x8080808080800401ULL, 0x8080808080040100ULL, 0x8080808080800402ULL,
+	0x8080808080040200ULL, 0x8080808080040201ULL, 0x8080808004020100ULL,
+	0x8080808080800403ULL, 0x8080808080040300ULL, 0x8080808080040301ULL,
+	0x8080808004030100ULL, 0x8080808080040302ULL, 0x8080808004030200ULL,
+	0x8080808004030201ULL, 0x8080800403020100ULL, 0x8080808080808005ULL,
+	0x8080808080800500ULL, 0x8080808080800501ULL, 0x8080808080050100ULL,
+	0x8080808080800502ULL, 0x8080808080050200ULL, 0x8080808080050201ULL,
+	0x8080808005020100ULL, 0x8080808080800503ULL, 0x8080808080050300ULL,
+	0x8080808080050301ULL, 0x8080808005030100ULL, 0x8080808080050302ULL,
+	0x8080808005030200ULL, 0x8080808005030201ULL, 0x8080800503020100ULL,
+	0x8080808080800504ULL, 0x8080808080050400ULL, 0x8080808080050401ULL,
+	0x8080808005040100ULL, 0x8080808080050402ULL, 0x8080808005040200ULL,
+	0x8080808005040201ULL, 0x8080800504020100ULL, 0x8080808080050403ULL,
+	0x8080808005040300ULL, 0x8080808005040301ULL, 0x8080800504030100ULL,
+	0x8080808005040302ULL, 0x8080800504030200ULL, 0x8080800504030201ULL,
+	0x8080050403020100ULL, 0x8080808080808006ULL, 0x8080808080800600ULL,
+	0x8080808080800601ULL, 0x8080808080060100ULL, 0x8080808080800602ULL,
+	0x8080808080060200ULL, 0x8080808080060201ULL, 0x8080808006020100ULL,
+	0x8080808080800603ULL, 0x8080808080060300ULL, 0x8080808080060301ULL,
+	0x8080808006030100ULL, 0x8080808080060302ULL, 0x8080808006030200ULL,
+	0x8080808006030201ULL, 0x8080800603020100ULL, 0x8080808080800604ULL,
+	0x8080808080060400ULL, 0x8080808080060401ULL, 0x8080808006040100ULL,
+	0x8080808080060402ULL, 0x8080808006040200ULL, 0x8080808006040201ULL,
+	0x8080800604020100ULL, 0x8080808080060403ULL, 0x8080808006040300ULL,
+	0x8080808006040301ULL, 0x8080800604030100ULL, 0x8080808006040302ULL,
+	0x8080800604030200ULL, 0x8080800604030201ULL, 0x8080060403020100ULL,
+	0x8080808080800605ULL, 0x8080808080060500ULL, 0x8080808080060501ULL,
+	0x8080808006050100ULL, 0x8080808080060502ULL, 0x8080808006050200ULL,
+	0x8080808006050201ULL, 0x8080800605020100ULL, 0x8080808080060503ULL,
+	0x8080808006050300ULL, 0x8080808006050301ULL, 0x8080800605030100ULL,
+	0x8080808006050302ULL, 0x8080800605030200ULL, 0x8080800605030201ULL,
+	0x8080060503020100ULL, 0x8080808080060504ULL, 0x8080808006050400ULL,
+	0x8080808006050401ULL, 0x8080800605040100ULL, 0x8080808006050402ULL,
+	0x8080800605040200ULL, 0x8080800605040201ULL, 0x8080060504020100ULL,
+	0x8080808006050403ULL, 0x8080800605040300ULL, 0x8080800605040301ULL,
+	0x8080060504030100ULL, 0x8080800605040302ULL, 0x8080060504030200ULL,
+	0x8080060504030201ULL, 0x8006050403020100ULL, 0x8080808080808007ULL,
+	0x8080808080800700ULL, 0x8080808080800701ULL, 0x8080808080070100ULL,
+	0x8080808080800702ULL, 0x8080808080070200ULL, 0x8080808080070201ULL,
+	0x8080808007020100ULL, 0x8080808080800703ULL, 0x8080808080070300ULL,
+	0x8080808080070301ULL, 0x8080808007030100ULL, 0x8080808080070302ULL,
+	0x8080808007030200ULL, 0x8080808007030201ULL, 0x8080800703020100ULL,
+	0x8080808080800704ULL, 0x8080808080070400ULL, 0x8080808080070401ULL,
+	0x8080808007040100ULL, 0x8080808080070402ULL, 0x8080808007040200ULL,
+	0x8080808007040201ULL, 0x8080800704020100ULL, 0x8080808080070403ULL,
+	0x8080808007040300ULL, 0x8080808007040301ULL, 0x8080800704030100ULL,
+	0x8080808007040302ULL, 0x8080800704030200ULL, 0x8080800704030201ULL,
+	0x8080070403020100ULL, 0x8080808080800705ULL, 0x8080808080070500ULL,
+	0x8080808080070501ULL, 0x8080808007050100ULL, 0x8080808080070502ULL,
+	0x8080808007050200ULL, 0x8080808007050201ULL, 0x8080800705020100ULL,
+	0x8080808080070503ULL, 0x8080808007050300ULL, 0x8080808007050301ULL,
+	0x8080800705030100ULL, 0x8080808007050302ULL, 0x8080800705030200ULL,
+	0x8080800705030201ULL, 0x8080070503020100ULL, 0x8080808080070504ULL,
+	0x8080808007050400ULL, 0x8080808007050401ULL, 0x8080800705040100ULL,
+	0x8080808007050402ULL, 0x8080800705040200ULL, 0x8080800705040201ULL,
+	0x8080070504020100ULL, 0x8080808007050403ULL, 0x8080800705040300ULL,
+	0x8080800705040301ULL, 0x8080070504030100ULL, 0x8080800705040302ULL,
+	0x8080070504030200ULL, 0x8080070504030201ULL, 0x8007050403020100ULL,
+	0x8080808080800706ULL, 0x8080808080070600ULL, 0x8080808080070601ULL,
+	0x8080808007060100ULL, 0x8080808080070602ULL, 0x8080808007060200ULL,
+	0x8080808007060201ULL, 0x8080800706020100ULL, 0x8080808080070603ULL,
+	0x8080808007060300ULL, 0x8080808007060301ULL, 0x8080800706030100ULL,
+	0x8080808007060302ULL, 0x8080800706030200ULL, 0x8080800706030201ULL,
+	0x8080070603020100ULL, 0x8080808080070604ULL, 0x8080808007060400ULL,
+	0x8080808007060401ULL, 0x8080800706040100ULL, 0x8080808007060402ULL,
+	0x8080800706040200ULL, 0x8080800706040201ULL, 0x8080070604020100ULL,
+	0x8080808007060403ULL, 0x8080800706040300ULL, 0x8080800706040301ULL,
+	0x8080070604030100ULL, 0x8080800706040302ULL, 0x8080070604030200ULL,
+	0x8080070604030201ULL, 0x8007060403020100ULL, 0x8080808080070605ULL,
+	0x8080808007060500ULL, 0x8080808007060501ULL, 0x8080800706050100ULL,
+	0x8080808007060502ULL, 0x8080800706050200ULL, 0x8080800706050201ULL,
+	0x8080070605020100ULL, 0x8080808007060503ULL, 0x8080800706050300ULL,
+	0x8080800706050301ULL, 0x8080070605030100ULL, 0x8080800706050302ULL,
+	0x8080070605030200ULL, 0x8080070605030201ULL, 0x8007060503020100ULL,
+	0x8080808007060504ULL, 0x8080800706050400ULL, 0x8080800706050401ULL,
+	0x8080070605040100ULL, 0x8080800706050402ULL, 0x8080070605040200ULL,
+	0x8080070605040201ULL, 0x8007060504020100ULL, 0x8080800706050403ULL,
+	0x8080070605040300ULL, 0x8080070605040301ULL, 0x8007060504030100ULL,
+	0x8080070605040302ULL, 0x8007060504030200ULL, 0x8007060504030201ULL,
+	0x0706050403020100ULL,
+};
+
+/*
+ * Copies the bytes of the block that are set in `keep` to `out + o`, and
+ * returns the new output offset.
+ */
+static size_t
+jsp_min_compact(char *p, jsp_min_blk_t *b, uint64_t keep, char *out,
+    size_t o)
+{
+	int k;
+	(void) p;
+	for (k = 0; k < 4; k++) {
+		uint64_t lo = keep & 0xff;
+		uint64_t hi = (keep >> 8) & 0xff;
+		__m128i c = _mm_shuffle_epi8(b->jspk_v[k], _mm_set_epi64x(
+		    (int64_t)(jsp_min_shuf[hi] + 0x0808080808080808ULL),
+		    (int64_t)jsp_min_shuf[lo]));
+		_mm_storel_epi64((__m128i *)(out + o), c);
+		o += jsp_min_popc8(lo);
+		_mm_storel_epi64((__m128i *)(out + o), _mm_srli_si128(c, 8));
+		o += jsp_min_popc8(hi);
+		keep >>= 16;
+	}
+	return (o);
+}
+
+#else
+
+static size_t
+jsp_min_compact(char *p, jsp_min_blk_t *b, uint64_t keep, char *out,
+    size_t o)
+{
+	int j, k;
+	(void) b;
+	if (keep == ~0ULL) {
+		if (out + o != p) {
+			(void) memmove(out + o, p, JSP_MIN_BLK);
+		}
+		return (o + JSP_MIN_BLK);
+	}
+	for (j = 0; j < JSP_MIN_BLK; j += 8) {
+		uint64_t m = (keep >> j) & 0xff;
+		if (m == 0xff) {
+			(void) memmove(out + o, p + j, 8);
+			o += 8;
+			continue;
+		}
+		for (k = 0; k < 8; k++) {
+			if ((m >> k) & 1) {
+				out[o++] = p[j + k];
+			}
+		}
+	}
+	return (o);
+}
+
+#endif
+
+static size_t
+jsp_min_bytes(char *in, size_t sz, char *out, size_t o, int *st)
+{
+	size_t i = 0;
+	while (i < sz) {
+		char c = in[i++];
+		if (*st & JSP_MIN_ESC) {
+			*st &= ~JSP_MIN_ESC;
+		} else if (*st & JSP_MIN_STR) {
+			if (c == '\\') {
+				*st |= JSP_MIN_ESC;
+			} else if (c == '"') {
+				*st &= ~JSP_MIN_STR;
+			}
+		} else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			continue;
+		} else if (c == '"') {
+			*st |= JSP_MIN_STR;
+		}
+		out[o++] = c;
+	}
+	return (o);
+}
+
+/*
+ * Minifies `sz` bytes of `in` into `out`, which must have room for `sz`
+ * bytes, and may be `in`. Returns the size of the minified text.
+ */
+size_t
+jsp_minify(char *in, size_t sz, char *out)
+{
+	size_t i = 0;
+	size_t o = 0;
+	uint64_t str = 0;
+	uint64_t esc = 0;
+	while (sz - i >= JSP_MIN_BLK) {
+		jsp_min_blk_t b;
+		jsp_min_load(in + i, &b);
+		uint64_t q = b.jspk_quote & ~jsp_min_escaped(b.jspk_bs, &esc);
+		uint64_t s = jsp_min_pxor(q) ^ str;
+		str = 0 - (s >> 63);
+		o = jsp_min_compact(in + i, &b, ~(b.jspk_ws & ~s), out, o);
+		i += JSP_MIN_BLK;
+	}
+	int st = 0;
+	if (str != 0) {
+		st = JSP_MIN_STR | (esc ? JSP_MIN_ESC : 0);
+	}
+	return (jsp_min_bytes(in + i, sz - i, out, o, &st));
+}
+
+/*
+ * Canonical Form
+ * ==============
+ *
+ * jsp_canonicalize() serializes a (possibly edited) document in a canonical
+ * form, loosely after RFC 8785, so that documents that mean the same thing
+ * serialize to the same bytes, and can be hashed and compared as such:
+ *
+ *  - there is no whitespace,
+ *
+ *  - object members are sorted by key, and
+ *
+ *  - numbers are written the way ECMAScript writes doubles: the shortest
+ *    digit string that reads back as the same double, in plain notation if
+ *    the exponent is in [-7, 21), and in exponent notation otherwise (so 1.0,
+ *    1e0, and 10e-1 all become 1, and -0 becomes 0).
+ *
+ * Where we part ways with RFC 8785: keys are sorted by their raw bytes, and
+ * strings are emitted as they appear in the input, escapes and all. We don't
+ * decode strings anywhere else either, and for the common case of unescaped
+ * UTF-8, byte order is code point order. Numbers too long for us to convert
+ * (or too large for a double) are emitted as they are.
+ */
+
+static int
+jsp_canon_cmp(jsp_ast_t *a, uint32_t i1, uint32_t i2)
+{
+	jsp_node_t *n1 = JSP_NODE(a, i1);
+	jsp_node_t *n2 = JSP_NODE(a, i2);
+	uint32_t len = n1->jspn_klen < n2->jspn_klen ?
+	    n1->jspn_klen : n2->jspn_klen;
+	int r = memcmp(JSP_KEY(a, i1), JSP_KEY(a, i2), len);
+	if (r != 0) {
+		return (r);
+	}
+	return (n1->jspn_klen < n2->jspn_klen ? -1 :
+	    n1->jspn_klen > n2->jspn_klen);
+}
+
+/*
+ * Sorts the members in `v` by key, with a merge sort, since objects can be
+ * large, and qsort has no way to pass the AST to the comparator. `tmp` must
+ * have room for `n` members. Members with the same key keep their order, which
+ * jsp_node_equal() relies on as well.
+ */
+void
+jsp_canon_sort(jsp_ast_t *a, uint32_t *v, uint32_t *tmp, uint32_t n)
+{
+	if (n < 2) {
+		return;
+	}
+	uint32_t h = n / 2;
+	jsp_canon_sort(a, v, tmp, h);
+	jsp_canon_sort(a, v + h, tmp, n - h);
+	uint32_t i = 0;
+	uint32_t j = h;
+	uint32_t k = 0;
+	while (i < h && j < n) {
+		/* Ties keep their document order. */
+		if (jsp_canon_cmp(a, v[j], v[i]) < 0) {
+			tmp[k++] = v[j++];
+		} else {
+			tmp[k++] = v[i++];
+		}
+	}
+	while (i < h) {
+		tmp[k++] = v[i++];
+	}
+	while (j < n) {
+		tmp[k++] = v[j++];
+	}
+	bcopy(tmp, v, n * sizeof (uint32_t));
+}
+
+/*
+ * Writes the canonical form of the number `num` into `out`, which has room
+ * for 32 bytes, and returns its length, or 0 if the number should be emitted
+ * as is.
+ */
+static size_t
+jsp_canon_num(char *num, size_t len, char *out)
+{
+	char b[64];
+	if (len >= sizeof (b)) {
+		return (0);
+	}
+	bcopy(num, b, len);
+	b[len] = '\0';
+	double d = strtod(b, NULL);
+	if (!isfinite(d)) {
+		return (0);
+	}
+	if (d == 0) {
+		out[0] = '0';
+		return (1);
+	}
+
+	/*
+	 * Find the shortest precision that round-trips, and pull the digits
+	 * and the decimal exponent out of "-d.ddde+xx".
+	 */
+	int p = 1;
+	while (p < 17) {
+		(void) snprintf(b, sizeof (b), "%.*e", p - 1, d);
+		if (strtod(b, NULL) == d) {
+			break;
+		}
+		p++;
+	}
+	if (p == 17) {
+		(void) snprintf(b, sizeof (b), "%.*e", p - 1, d);
+	}
+	char *s = b;
+	size_t o = 0;
+	if (*s == '-') {
+		out[o++] = '-';
+		s++;
+	}
+	char dig[20];
+	int k = 0;
+	while (*s != 'e') {
+		if (*s != '.') {
+			dig[k++] = *s;
+		}
+		s++;
+	}
+	int n = atoi(s + 1) + 1;
+	while (k > 1 && dig[k - 1] == '0') {
+		k--;
+	}
+
+	int i;
+	if (k <= n && n <= 21) {
+		bcopy(dig, out + o, k);
+		o += k;
+		for (i = k; i < n; i++) {
+			out[o++] = '0';
+		}
+	} else if (0 < n && n <= 21) {
+		bcopy(dig, out + o, n);
+		o += n;
+		out[o++] = '.';
+		bcopy(dig + n, out + o, k - n);
+		o += k - n;
+	} else if (-6 < n && n <= 0) {
+		out[o++] = '0';
+		out[o++] = '.';
+		for (i = n; i < 0; i++) {
+			out[o++] = '0';
+		}
+		bcopy(dig, out + o, k);
+		o += k;
+	} else {
+		out[o++] = dig[0];
+		if (k > 1) {
+			out[o++] = '.';
+			bcopy(dig + 1, out + o, k - 1);
+			o += k - 1;
+		}
+		o += snprintf(out + o, 32 - o, "e%c%d", n - 1 < 0 ? '-' : '+',
+		    n - 1 < 0 ? 1 - n : n - 1);
+	}
+	return (o);
+}
+
+static int
+jsp_canon_emit(jsp_ast_t *a, uint32_t idx, jsp_wbuf_t *b)
+{
+	jsp_node_t *n = JSP_NODE(a, idx);
+	char nb[32];
+	size_t nsz;
+	uint32_t c;
+
+	switch (n->jspn_type) {
+	case INTEGER:
+	case FLOAT:
+		nsz = jsp_canon_num(JSP_VAL(a, idx), n->jspn_len, nb);
+		if (nsz == 0) {
+			jsp_wbuf_put(b, JSP_VAL(a, idx), n->jspn_len);
+		} else {
+			jsp_wbuf_put(b, nb, nsz);
+		}
+		return (0);
+	case ARRAY:
+		jsp_wbuf_put(b, "[", 1);
+		c = n->jspn_child;
+		while (c != JSP_NONE) {
+			if (c != n->jspn_child) {
+				jsp_wbuf_put(b, ",", 1);
+			}
+			if (jsp_canon_emit(a, c, b) != 0) {
+				return (-1);
+			}
+			c = JSP_NODE(a, c)->jspn_next;
+		}
+		jsp_wbuf_put(b, "]", 1);
+		return (0);
+	case OBJECT:
+		break;
+	default:
+		jsp_wbuf_put(b, JSP_VAL(a, idx), n->jspn_len);
+		return (0);
+	}
+
+	uint32_t cnt = 0;
+	c = n->jspn_child;
+	while (c != JSP_NONE) {
+		cnt++;
+		c = JSP_NODE(a, c)->jspn_next;
+	}
+	uint32_t *v = NULL;
+	if (cnt > 0) {
+		v = malloc(2 * (size_t)cnt * sizeof (uint32_t));
+		if (v == NULL) {
+			return (-1);
+		}
+	}
+	uint32_t i = 0;
+	c = n->jspn_child;
+	while (c != JSP_NONE) {
+		v[i++] = c;
+		c = JSP_NODE(a, c)->jspn_next;
+	}
+	jsp_canon_sort(a, v, v + cnt, cnt);
+	jsp_wbuf_put(b, "{", 1);
+	i = 0;
+	while (i < cnt) {
+		jsp_node_t *cn = JSP_NODE(a, v[i]);
+		if (i > 0) {
+			jsp_wbuf_put(b, ",", 1);
+		}
+		jsp_wbuf_put(b, "\"", 1);
+		jsp_wbuf_put(b, JSP_KEY(a, v[i]), cn->jspn_klen);
+		jsp_wbuf_put(b, "\":", 2);
+		if (jsp_canon_emit(a, v[i], b) != 0) {
+			free(v);
+			return (-1);
+		}
+		i++;
+	}
+	jsp_wbuf_put(b, "}", 1);
+	free(v);
+	return (0);
+}
+
+/*
+ * Like jsp_serialize(), writes at most `sz` bytes to `out`, and returns the
+ * size of the whole canonical form. Returns 0, with errno set to ENOMEM, if
+ * we couldn't allocate the space to sort an object's members.
+ */
+size_t
+jsp_canonicalize(jsp_ast_t *a, char *out, size_t sz)
+{
+	jsp_wbuf_t b;
+	b.jspb_out = out;
+	b.jspb_sz = out == NULL ? 0 : sz;
+	b.jspb_off = 0;
+	if (jsp_canon_emit(a, a->jspa_root, &b) != 0) {
+		errno = ENOMEM;
+		return (0);
+	}
+	return (b.jspb_off);
+}
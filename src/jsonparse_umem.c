@@ -8,3 +8,703 @@
  * Copyright (c) 2016, Joyent, Inc.
  */
 #include "jsonparse_impl.h"
+
+/*
+ * Memory Management
+ * =================
+ *
+ * The objects we allocate all the time -- walkers, AST wrappers, and chunks of
+ * index nodes -- come out of object caches. On illumos (when built with UMEM)
+ * these are umem caches, which gives us per-CPU magazines and keeps the hot
+ * path off of malloc's locks. Elsewhere, we use a minimal slab allocator with
+ * per-thread magazines in front of it (see below).
+ *
+ * On top of this, every AST has a memory budget. All of the memory that is
+ * allocated on behalf of an AST (the wrapper itself, its node chunks and chunk
+ * directory, its edit buffer, its patch journal, and any keys that it adds to
+ * a shared key dictionary) is charged against it, and an allocation that would
+ * exceed the budget fails, just as if we had run out of memory. A budget of 0
+ * means there is no limit.
+ */
+
+#define	JSP_SLAB_SZ	(128 * 1024)
+
+#ifdef UMEM
+
+typedef umem_cache_t jsp_cache_t;
+
+static jsp_cache_t *
+jsp_cache_create(char *name, size_t sz)
+{
+	return (umem_cache_create(name, sz, 0, NULL, NULL, NULL, NULL, NULL,
+	    0));
+}
+
+static void *
+jsp_cache_alloc(jsp_cache_t *c)
+{
+	return (umem_cache_alloc(c, UMEM_DEFAULT));
+}
+
+static void
+jsp_cache_free(jsp_cache_t *c, void *p)
+{
+	umem_cache_free(c, p);
+}
+
+#else
+
+/*
+ * Without umem, each cache carves slabs (of at least JSP_SLAB_SZ, and enough
+ * for JSP_SLAB_MIN objects, and aligned to their own size, so that an object's
+ * slab can be found from its address) into objects.
+ * Each slab keeps its own free-list, and the cache keeps a list of the slabs
+ * that have free objects. Once a cache has JSP_SLAB_KEEP empty slabs, any
+ * other slab whose objects have all been freed is given back to the system.
+ *
+ * In front of that, each thread keeps a magazine of free objects per cache,
+ * and only takes the cache's lock to move half a magazine's worth of objects
+ * in or out. When a thread exits, its magazines are emptied back into the
+ * caches.
+ */
+#define	JSP_NCACHES	3
+#define	JSP_MAG_SZ	32
+#define	JSP_SLAB_KEEP	4
+#define	JSP_SLAB_MIN	16
+#define	JSP_SLAB_HDR	((sizeof (jsp_slab_t) + 15) & ~(size_t)15)
+
+typedef struct jsp_slab {
+	struct jsp_slab	*jspl_next;
+	struct jsp_slab	*jspl_prev;
+	void		*jspl_free;
+	uint32_t	jspl_nfree;
+} jsp_slab_t;
+
+typedef struct jsp_cache {
+	pthread_mutex_t	jspm_lock;
+	char		*jspm_name;
+	size_t		jspm_objsz;
+	size_t		jspm_slabsz;
+	uint32_t	jspm_idx;
+	uint32_t	jspm_nobjs;
+	jsp_slab_t	*jspm_slabs;
+	uint32_t	jspm_nempty;
+} jsp_cache_t;
+
+typedef struct jsp_mag {
+	uint32_t	jspg_n;
+	void		*jspg_objs[JSP_MAG_SZ];
+} jsp_mag_t;
+
+static jsp_cache_t *jsp_caches[JSP_NCACHES];
+static uint32_t jsp_ncaches;
+static pthread_key_t jsp_mag_key;
+static __thread jsp_mag_t jsp_mags[JSP_NCACHES];
+static __thread int jsp_mags_live;
+
+static void jsp_mag_exit(void *);
+
+/*
+ * Only called from jsp_mem_init(), so there are no races here.
+ */
+static jsp_cache_t *
+jsp_cache_create(char *name, size_t sz)
+{
+	if (jsp_ncaches == JSP_NCACHES || (jsp_ncaches == 0 &&
+	    pthread_key_create(&jsp_mag_key, jsp_mag_exit) != 0)) {
+		return (NULL);
+	}
+	jsp_cache_t *c = calloc(1, sizeof (jsp_cache_t));
+	if (c == NULL) {
+		return (NULL);
+	}
+	(void) pthread_mutex_init(&c->jspm_lock, NULL);
+	c->jspm_name = name;
+	/*
+	 * Every object must be able to hold the free-list link, and we keep
+	 * them all 16-byte aligned.
+	 */
+	c->jspm_objsz = (sz + 15) & ~(size_t)15;
+	c->jspm_slabsz = JSP_SLAB_SZ;
+	while ((c->jspm_slabsz - JSP_SLAB_HDR) / c->jspm_objsz < JSP_SLAB_MIN) {
+		c->jspm_slabsz *= 2;
+	}
+	c->jspm_nobjs = (c->jspm_slabsz - JSP_SLAB_HDR) / c->jspm_objsz;
+	c->jspm_idx = jsp_ncaches;
+	jsp_caches[jsp_ncaches++] = c;
+	return (c);
+}
+
+static void
+jsp_slab_link(jsp_cache_t *c, jsp_slab_t *s)
+{
+	s->jspl_prev = NULL;
+	s->jspl_next = c->jspm_slabs;
+	if (s->jspl_next != NULL) {
+		s->jspl_next->jspl_prev = s;
+	}
+	c->jspm_slabs = s;
+}
+
+static void
+jsp_slab_unlink(jsp_cache_t *c, jsp_slab_t *s)
+{
+	if (s->jspl_prev != NULL) {
+		s->jspl_prev->jspl_next = s->jspl_next;
+	} else {
+		c->jspm_slabs = s->jspl_next;
+	}
+	if (s->jspl_next != NULL) {
+		s->jspl_next->jspl_prev = s->jspl_prev;
+	}
+}
+
+/*
+ * Carves a new slab into objects. The caller holds the lock.
+ */
+static jsp_slab_t *
+jsp_slab_create(jsp_cache_t *c)
+{
+	void *p;
+	if (posix_memalign(&p, c->jspm_slabsz, c->jspm_slabsz) != 0) {
+		return (NULL);
+	}
+	jsp_slab_t *s = p;
+	char *base = (char *)p + JSP_SLAB_HDR;
+	uint32_t n = c->jspm_nobjs;
+	s->jspl_free = NULL;
+	s->jspl_nfree = n;
+	while (n > 0) {
+		n--;
+		void **o = (void **)(base + n * c->jspm_objsz);
+		*o = s->jspl_free;
+		s->jspl_free = o;
+	}
+	jsp_slab_link(c, s);
+	c->jspm_nempty++;
+	return (s);
+}
+
+/*
+ * Takes an object from the cache's slabs. The caller holds the lock.
+ */
+static void *
+jsp_slab_get(jsp_cache_t *c)
+{
+	jsp_slab_t *s = c->jspm_slabs;
+	if (s == NULL && (s = jsp_slab_create(c)) == NULL) {
+		return (NULL);
+	}
+	if (s->jspl_nfree == c->jspm_nobjs) {
+		c->jspm_nempty--;
+	}
+	void **o = s->jspl_free;
+	s->jspl_free = *o;
+	if (--s->jspl_nfree == 0) {
+		jsp_slab_unlink(c, s);
+	}
+	return (o);
+}
+
+/*
+ * Returns an object to its slab. The caller holds the lock.
+ */
+static void
+jsp_slab_put(jsp_cache_t *c, void *p)
+{
+	jsp_slab_t *s = (jsp_slab_t *)((uintptr_t)p &
+	    ~(uintptr_t)(c->jspm_slabsz - 1));
+	void **o = p;
+	if (s->jspl_nfree == 0) {
+		jsp_slab_link(c, s);
+	}
+	*o = s->jspl_free;
+	s->jspl_free = o;
+	if (++s->jspl_nfree == c->jspm_nobjs) {
+		if (c->jspm_nempty == JSP_SLAB_KEEP) {
+			jsp_slab_unlink(c, s);
+			free(s);
+		} else {
+			c->jspm_nempty++;
+		}
+	}
+}
+
+/*
+ * Returns this thread's magazine for the cache, making sure that the thread
+ * will empty its magazines when it exits.
+ */
+static jsp_mag_t *
+jsp_mag(jsp_cache_t *c)
+{
+	if (!jsp_mags_live) {
+		(void) pthread_setspecific(jsp_mag_key, jsp_mags);
+		jsp_mags_live = 1;
+	}
+	return (&jsp_mags[c->jspm_idx]);
+}
+
+static void
+jsp_mag_drain(jsp_cache_t *c, jsp_mag_t *m, uint32_t n)
+{
+	(void) pthread_mutex_lock(&c->jspm_lock);
+	while (n > 0 && m->jspg_n > 0) {
+		jsp_slab_put(c, m->jspg_objs[--m->jspg_n]);
+		n--;
+	}
+	(void) pthread_mutex_unlock(&c->jspm_lock);
+}
+
+static void
+jsp_mag_exit(void *arg)
+{
+	jsp_mag_t *mags = arg;
+	uint32_t i = 0;
+	while (i < jsp_ncaches) {
+		jsp_mag_drain(jsp_caches[i], &mags[i], JSP_MAG_SZ);
+		i++;
+	}
+}
+
+static void *
+jsp_cache_alloc(jsp_cache_t *c)
+{
+	jsp_mag_t *m = jsp_mag(c);
+	if (m->jspg_n == 0) {
+		(void) pthread_mutex_lock(&c->jspm_lock);
+		while (m->jspg_n < JSP_MAG_SZ / 2) {
+			void *o = jsp_slab_get(c);
+			if (o == NULL) {
+				break;
+			}
+			m->jspg_objs[m->jspg_n++] = o;
+		}
+		(void) pthread_mutex_unlock(&c->jspm_lock);
+		if (m->jspg_n == 0) {
+			return (NULL);
+		}
+	}
+	return (m->jspg_objs[--m->jspg_n]);
+}
+
+static void
+jsp_cache_free(jsp_cache_t *c, void *p)
+{
+	jsp_mag_t *m = jsp_mag(c);
+	if (m->jspg_n == JSP_MAG_SZ) {
+		jsp_mag_drain(c, m, JSP_MAG_SZ / 2);
+	}
+	m->jspg_objs[m->jspg_n++] = p;
+}
+
+#endif
+
+static jsp_cache_t *jsp_ast_cache;
+static jsp_cache_t *jsp_walk_cache;
+static jsp_cache_t *jsp_chunk_cache;
+static pthread_once_t jsp_mem_once = PTHREAD_ONCE_INIT;
+
+static void
+jsp_mem_init()
+{
+	jsp_ast_cache = jsp_cache_create("jsp_ast_cache", sizeof (jsp_ast_t));
+	jsp_walk_cache = jsp_cache_create("jsp_walk_cache",
+	    sizeof (jsp_walk_t));
+	jsp_chunk_cache = jsp_cache_create("jsp_chunk_cache",
+	    JSP_CHUNK_NODES * sizeof (jsp_node_t));
+}
+
+static int
+jsp_mem_ready()
+{
+	(void) pthread_once(&jsp_mem_once, jsp_mem_init);
+	return (jsp_ast_cache != NULL && jsp_walk_cache != NULL &&
+	    jsp_chunk_cache != NULL);
+}
+
+int
+jsp_mem_charge(jsp_ast_t *a, size_t sz)
+{
+	if (a->jspa_budget != 0 &&
+	    (sz > a->jspa_budget || a->jspa_used > a->jspa_budget - sz)) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	a->jspa_used += sz;
+	return (0);
+}
+
+void
+jsp_mem_uncharge(jsp_ast_t *a, size_t sz)
+{
+	a->jspa_used -= sz;
+}
+
+/*
+ * A realloc that is charged against the AST's budget.
+ */
+void *
+jsp_mem_realloc(jsp_ast_t *a, void *p, size_t old, size_t new)
+{
+	if (new > old && jsp_mem_charge(a, new - old) != 0) {
+		return (NULL);
+	}
+	void *r = realloc(p, new);
+	if (r == NULL) {
+		if (new > old) {
+			jsp_mem_uncharge(a, new - old);
+		}
+		return (NULL);
+	}
+	if (old > new) {
+		jsp_mem_uncharge(a, old - new);
+	}
+	return (r);
+}
+
+jsp_ast_t *
+jsp_ast_alloc(size_t budget)
+{
+	if (!jsp_mem_ready() || (budget != 0 && budget < sizeof (jsp_ast_t))) {
+		return (NULL);
+	}
+	jsp_ast_t *a = jsp_cache_alloc(jsp_ast_cache);
+	if (a == NULL) {
+		return (NULL);
+	}
+	bzero(a, sizeof (jsp_ast_t));
+	a->jspa_budget = budget;
+	a->jspa_used = sizeof (jsp_ast_t);
+	return (a);
+}
+
+void
+jsp_ast_free(jsp_ast_t *a)
+{
+	jsp_cache_free(jsp_ast_cache, a);
+}
+
+jsp_walk_t *
+jsp_walk_alloc()
+{
+	if (!jsp_mem_ready()) {
+		return (NULL);
+	}
+	jsp_walk_t *w = jsp_cache_alloc(jsp_walk_cache);
+	if (w != NULL) {
+		bzero(w, sizeof (jsp_walk_t));
+	}
+	return (w);
+}
+
+void
+jsp_walk_free(jsp_walk_t *w)
+{
+	jsp_cache_free(jsp_walk_cache, w);
+}
+
+/*
+ * Adds a chunk of nodes to the AST's index, growing the chunk directory if
+ * need be. Nodes never move once allocated, but we still refer to them by
+ * index, since that's half the size of a pointer.
+ */
+static int jsp_arena_chunk(jsp_ast_t *);
+
+static void
+jsp_chunk_init(jsp_chunk_t *c, jsp_node_t *n)
+{
+	c->jsph_nodes = n;
+	c->jsph_delta = 0;
+	c->jsph_min = UINT64_MAX;
+	c->jsph_max = 0;
+}
+
+int
+jsp_chunk_add(jsp_ast_t *a)
+{
+	if (a->jspa_arena != NULL && a->jspa_arena->jspr_fill == a) {
+		return (jsp_arena_chunk(a));
+	}
+	if (!jsp_mem_ready()) {
+		return (-1);
+	}
+	if (a->jspa_nchunks == a->jspa_maxchunks) {
+		uint32_t max = a->jspa_maxchunks ? a->jspa_maxchunks * 2 : 8;
+		if (max > (JSP_NONE >> JSP_CHUNK_SHIFT)) {
+			return (-1);
+		}
+		jsp_chunk_t *c = jsp_mem_realloc(a, a->jspa_chunks,
+		    a->jspa_maxchunks * sizeof (jsp_chunk_t),
+		    max * sizeof (jsp_chunk_t));
+		if (c == NULL) {
+			return (-1);
+		}
+		a->jspa_chunks = c;
+		a->jspa_maxchunks = max;
+	}
+	size_t csz = JSP_CHUNK_NODES * sizeof (jsp_node_t);
+	if (jsp_mem_charge(a, csz) != 0) {
+		return (-1);
+	}
+	jsp_node_t *n = jsp_cache_alloc(jsp_chunk_cache);
+	if (n == NULL) {
+		jsp_mem_uncharge(a, csz);
+		errno = ENOMEM;
+		return (-1);
+	}
+	jsp_chunk_init(&a->jspa_chunks[a->jspa_nchunks++], n);
+	return (0);
+}
+
+void
+jsp_chunks_free(jsp_ast_t *a)
+{
+	if (a->jspa_borrowed) {
+		/* The arena owns these. */
+		a->jspa_chunks = NULL;
+		a->jspa_nchunks = 0;
+		a->jspa_maxchunks = 0;
+		a->jspa_nnodes = 0;
+		a->jspa_borrowed = 0;
+		return;
+	}
+	uint32_t i = 0;
+	while (i < a->jspa_nchunks) {
+		jsp_cache_free(jsp_chunk_cache, a->jspa_chunks[i].jsph_nodes);
+		i++;
+	}
+	jsp_mem_uncharge(a, a->jspa_nchunks * JSP_CHUNK_NODES *
+	    sizeof (jsp_node_t) + a->jspa_maxchunks * sizeof (jsp_chunk_t));
+	free(a->jspa_chunks);
+	a->jspa_chunks = NULL;
+	a->jspa_nchunks = 0;
+	a->jspa_maxchunks = 0;
+	a->jspa_nnodes = 0;
+}
+
+/*
+ * Batch Arenas
+ * ============
+ *
+ * When many small documents are parsed in one go, going to the caches for
+ * every AST and every (mostly empty) chunk of nodes costs more than the
+ * parse. So a batch parses into an arena instead: the ASTs, their nodes, and
+ * their chunk directories are bump-allocated from large blocks.
+ *
+ * While a document is being indexed, it is the arena's `fill` AST, and its
+ * chunks are carved off the top of the current block, while its chunk
+ * directory lives in a scratch array that the arena reuses. Once it has been
+ * indexed, it is sealed: the unused tail of its last chunk is handed back, so
+ * that the next document's nodes follow right after it, and its directory is
+ * copied into the arena. A document that fails to index is rewound.
+ *
+ * A sealed AST is `borrowed`. It has no room to grow, so the first time it
+ * needs another node (because it is being edited or re-parsed), its nodes are
+ * copied into chunks of its own, and it is treated like any other AST from
+ * then on. Either way, the AST itself stays in the arena, and the arena is
+ * freed when the last of its ASTs is destroyed.
+ *
+ * An arena is only ever filled by one thread, but its ASTs may be destroyed
+ * from any thread, so the reference count is updated atomically.
+ */
+
+#define	JSP_ARENA_SZ	(256 * 1024)
+
+jsp_arena_t *
+jsp_arena_create()
+{
+	return (calloc(1, sizeof (jsp_arena_t)));
+}
+
+/*
+ * Block data starts right after a 3-word header, so allocations are 8-byte
+ * aligned, which is all that ASTs and nodes need.
+ */
+static void *
+jsp_arena_alloc(jsp_arena_t *ar, size_t sz)
+{
+	sz = (sz + 7) & ~(size_t)7;
+	jsp_ablk_t *b = ar->jspr_blks;
+	if (b == NULL || b->jspb_sz - b->jspb_used < sz) {
+		size_t bsz = sz > JSP_ARENA_SZ ? sz : JSP_ARENA_SZ;
+		b = malloc(sizeof (jsp_ablk_t) + bsz);
+		if (b == NULL) {
+			return (NULL);
+		}
+		b->jspb_next = ar->jspr_blks;
+		b->jspb_used = 0;
+		b->jspb_sz = bsz;
+		ar->jspr_blks = b;
+	}
+	void *p = b->jspb_data + b->jspb_used;
+	b->jspb_used += sz;
+	return (p);
+}
+
+/*
+ * Allocates an AST from the arena, and makes it the one being filled.
+ */
+jsp_ast_t *
+jsp_arena_ast(jsp_arena_t *ar)
+{
+	jsp_ast_t *a = jsp_arena_alloc(ar, sizeof (jsp_ast_t));
+	if (a == NULL) {
+		return (NULL);
+	}
+	ar->jspr_mblk = ar->jspr_blks;
+	ar->jspr_mused = (char *)a - ar->jspr_blks->jspb_data;
+	bzero(a, sizeof (jsp_ast_t));
+	a->jspa_arena = ar;
+	a->jspa_used = sizeof (jsp_ast_t);
+	ar->jspr_fill = a;
+	return (a);
+}
+
+static int
+jsp_arena_chunk(jsp_ast_t *a)
+{
+	jsp_arena_t *ar = a->jspa_arena;
+	if (a->jspa_nchunks == ar->jspr_maxdir) {
+		uint32_t max = ar->jspr_maxdir ? ar->jspr_maxdir * 2 : 8;
+		if (max > (JSP_NONE >> JSP_CHUNK_SHIFT)) {
+			return (-1);
+		}
+		jsp_chunk_t *d = realloc(ar->jspr_dir,
+		    max * sizeof (jsp_chunk_t));
+		if (d == NULL) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		ar->jspr_dir = d;
+		ar->jspr_maxdir = max;
+	}
+	jsp_node_t *n = jsp_arena_alloc(ar,
+	    JSP_CHUNK_NODES * sizeof (jsp_node_t));
+	if (n == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	a->jspa_chunks = ar->jspr_dir;
+	a->jspa_maxchunks = ar->jspr_maxdir;
+	jsp_chunk_init(&a->jspa_chunks[a->jspa_nchunks++], n);
+	return (0);
+}
+
+/*
+ * Seals the AST that was being filled.
+ */
+int
+jsp_arena_seal(jsp_ast_t *a)
+{
+	jsp_arena_t *ar = a->jspa_arena;
+	uint32_t last = a->jspa_nchunks - 1;
+	size_t unused = ((size_t)(last + 1) << JSP_CHUNK_SHIFT) -
+	    a->jspa_nnodes;
+	jsp_ablk_t *b = ar->jspr_blks;
+	char *end = (char *)(a->jspa_chunks[last].jsph_nodes + JSP_CHUNK_NODES);
+	if (end == b->jspb_data + b->jspb_used) {
+		b->jspb_used -= unused * sizeof (jsp_node_t);
+	}
+	size_t dsz = a->jspa_nchunks * sizeof (jsp_chunk_t);
+	jsp_chunk_t *d = jsp_arena_alloc(ar, dsz);
+	if (d == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	bcopy(a->jspa_chunks, d, dsz);
+	a->jspa_chunks = d;
+	a->jspa_maxchunks = a->jspa_nchunks;
+	a->jspa_borrowed = 1;
+	ar->jspr_fill = NULL;
+	ar->jspr_refs++;
+	return (0);
+}
+
+/*
+ * Throws away the AST that was being filled, and everything that was
+ * allocated for it (unless it spilled into a new block).
+ */
+void
+jsp_arena_discard(jsp_ast_t *a)
+{
+	jsp_arena_t *ar = a->jspa_arena;
+	if (ar->jspr_blks == ar->jspr_mblk) {
+		ar->jspr_mblk->jspb_used = ar->jspr_mused;
+	}
+	ar->jspr_fill = NULL;
+}
+
+/*
+ * Gives a borrowed AST chunks of its own, so that it can grow.
+ */
+int
+jsp_arena_detach(jsp_ast_t *a)
+{
+	jsp_chunk_t *old = a->jspa_chunks;
+	uint32_t nchunks = a->jspa_nchunks;
+	uint32_t nnodes = a->jspa_nnodes;
+	a->jspa_chunks = NULL;
+	a->jspa_nchunks = 0;
+	a->jspa_maxchunks = 0;
+	a->jspa_borrowed = 0;
+	uint32_t i = 0;
+	while (i < nchunks) {
+		if (jsp_chunk_add(a) != 0) {
+			jsp_chunks_free(a);
+			a->jspa_chunks = old;
+			a->jspa_nchunks = nchunks;
+			a->jspa_maxchunks = nchunks;
+			a->jspa_nnodes = nnodes;
+			a->jspa_borrowed = 1;
+			return (-1);
+		}
+		uint32_t n = nnodes - (i << JSP_CHUNK_SHIFT);
+		if (n > JSP_CHUNK_NODES) {
+			n = JSP_CHUNK_NODES;
+		}
+		jsp_chunk_t *c = &a->jspa_chunks[i];
+		bcopy(old[i].jsph_nodes, c->jsph_nodes,
+		    n * sizeof (jsp_node_t));
+		c->jsph_delta = old[i].jsph_delta;
+		c->jsph_min = old[i].jsph_min;
+		c->jsph_max = old[i].jsph_max;
+		i++;
+	}
+	a->jspa_nnodes = nnodes;
+	return (0);
+}
+
+static void
+jsp_arena_free(jsp_arena_t *ar)
+{
+	jsp_ablk_t *b = ar->jspr_blks;
+	while (b != NULL) {
+		jsp_ablk_t *next = b->jspb_next;
+		free(b);
+		b = next;
+	}
+	free(ar);
+}
+
+void
+jsp_arena_rele(jsp_arena_t *ar)
+{
+	if (__atomic_sub_fetch(&ar->jspr_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		jsp_arena_free(ar);
+	}
+}
+
+/*
+ * Called once the batch is done filling the arena. If none of its ASTs made
+ * it, there is nobody left to free it.
+ */
+void
+jsp_arena_done(jsp_arena_t *ar)
+{
+	free(ar->jspr_dir);
+	ar->jspr_dir = NULL;
+	ar->jspr_maxdir = 0;
+	if (ar->jspr_refs == 0) {
+		jsp_arena_free(ar);
+	}
+}
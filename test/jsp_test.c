@@ -0,0 +1,966 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public License,
+ * v. 2.0. If a copy of the MPL was not distributed with this file, You can
+ * obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <jsonparse.h>
+
+/*
+ * Test Driver
+ * ===========
+ *
+ * Runs each of the tests in `tests` (or just the ones named on the command
+ * line), and exits non-zero if any of them failed. A test returns the number
+ * of checks that failed, and CHECK() reports each one as it fails.
+ *
+ * Everything here goes through the public interface only. Where a test needs
+ * to know what a document holds, it compares its serialization against the
+ * text it should hold.
+ */
+
+#define	CHECK(c)	((c) ? 0 : (fprintf(stderr, "%s:%d: %s\n",\
+			__FILE__, __LINE__, #c), 1))
+
+#define	S(s)		(s), strlen(s)
+
+/*
+ * Documents parsed against a shared dictionary find their members by id, and
+ * find the same members as a document parsed without one. A key that no
+ * document has used can't be found in any of them.
+ */
+static int
+test_keydict()
+{
+	int f = 0;
+	char *docs[] = {
+		"{\"a\": {\"b\": 1}, \"c\": 2}",
+		"{\"c\": {\"a\": {}}, \"b\": [4]}",
+	};
+	jsp_keydict_t *d = jsp_keydict_create();
+	jsp_ast_t *a1 = jsp_parse_dict(S(docs[0]), d);
+	jsp_ast_t *a2 = jsp_parse_dict(S(docs[1]), d);
+	jsp_ast_t *a3 = jsp_parse(S(docs[1]));
+	f += CHECK(a1 != NULL && a2 != NULL && a3 != NULL);
+	if (a1 == NULL || a2 == NULL || a3 == NULL) {
+		return (f);
+	}
+	f += CHECK(jsp_keydict_count(d) == 3);
+
+	uint32_t id;
+	size_t ksz;
+	f += CHECK(jsp_keydict_lookup(d, S("b"), &id) == 0);
+	char *k = jsp_keydict_key(d, id, &ksz);
+	f += CHECK(k != NULL && ksz == 1 && k[0] == 'b');
+	f += CHECK(jsp_keydict_lookup(d, S("z"), &id) != 0);
+
+	jsp_walk_t *w = jsp_create_walker();
+	f += CHECK(jsp_walk_member(a1, w, S("a")) == 0);
+	f += CHECK(jsp_walk_member(a1, w, S("b")) == 0);
+	f += CHECK(jsp_walk_member(a1, w, S("c")) != 0);
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a1, w, S("c")) == 0);
+
+	/* A walker that moves to another document starts at its root. */
+	jsp_ast_t *as[] = { a2, a3 };
+	size_t i;
+	for (i = 0; i < 2; i++) {
+		f += CHECK(jsp_walk_member(as[i], w, S("c")) == 0);
+		f += CHECK(jsp_walk_member(as[i], w, S("b")) != 0);
+		f += CHECK(jsp_walk_member(as[i], w, S("a")) == 0);
+		f += CHECK(jsp_walk_member(as[i], w, S("z")) != 0);
+		jsp_walk_reset(w);
+		f += CHECK(jsp_walk_member(as[i], w, S("b")) == 0);
+		f += CHECK(jsp_walk_member(as[i], w, S("a")) != 0);
+		jsp_walk_reset(w);
+	}
+
+	/* Interning a key later doesn't make it appear in a document. */
+	f += CHECK(jsp_keydict_intern(d, S("z"), &id) == 0);
+	f += CHECK(jsp_keydict_count(d) == 4);
+	f += CHECK(jsp_walk_member(a2, w, S("z")) != 0);
+
+	jsp_destroy_walker(w);
+	jsp_destroy(a1);
+	jsp_destroy(a2);
+	jsp_destroy(a3);
+	jsp_keydict_destroy(d);
+	return (f);
+}
+
+/*
+ * The scalar accessors read the value that the walker is on.
+ */
+static int
+test_value()
+{
+	int f = 0;
+	char *in = "{\"s\": \"a\\\"b\", \"i\": -42,"
+	    " \"u\": 18446744073709551615, \"big\": 18446744073709551616,"
+	    " \"x\": 2.5e-1, \"t\": true, \"o\": {}}";
+	jsp_ast_t *a = jsp_parse(S(in));
+	f += CHECK(a != NULL);
+	if (a == NULL) {
+		return (f);
+	}
+	jsp_walk_t *w = jsp_create_walker();
+	char buf[64];
+	uint64_t u;
+	double d;
+
+	f += CHECK(jsp_value_type(a, w) == OBJECT);
+	f += CHECK(jsp_value_size(a, w) == 0 && jsp_value_str(a, w, buf) != 0);
+	f += CHECK(jsp_walk_member(a, w, S("s")) == 0);
+	f += CHECK(jsp_value_type(a, w) == STRING);
+	f += CHECK(jsp_value_size(a, w) == 4);
+	f += CHECK(jsp_value_str(a, w, buf) == 0 &&
+	    strcmp(buf, "a\\\"b") == 0);
+	f += CHECK(jsp_value_int(a, w, &u) != 0);
+
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a, w, S("i")) == 0);
+	f += CHECK(jsp_value_int(a, w, &u) == 0 && (int64_t)u == -42);
+	f += CHECK(jsp_value_float(a, w, &d) == 0 && d == -42.0);
+	f += CHECK(jsp_value_str(a, w, buf) == 0 && strcmp(buf, "-42") == 0);
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a, w, S("u")) == 0);
+	f += CHECK(jsp_value_int(a, w, &u) == 0 && u == UINT64_MAX);
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a, w, S("big")) == 0);
+	errno = 0;
+	f += CHECK(jsp_value_int(a, w, &u) != 0 && errno == ERANGE);
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a, w, S("x")) == 0);
+	f += CHECK(jsp_value_type(a, w) == FLOAT);
+	f += CHECK(jsp_value_int(a, w, &u) != 0);
+	f += CHECK(jsp_value_float(a, w, &d) == 0 && d == 0.25);
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a, w, S("t")) == 0);
+	f += CHECK(jsp_value_type(a, w) == BOOL);
+	f += CHECK(jsp_value_str(a, w, buf) == 0 && strcmp(buf, "true") == 0);
+	jsp_destroy_walker(w);
+	jsp_destroy(a);
+	return (f);
+}
+
+static size_t
+ser(jsp_ast_t *a, char *out, size_t sz)
+{
+	size_t n = jsp_serialize(a, out, sz - 1);
+	if (n >= sz) {
+		n = sz - 1;
+	}
+	out[n] = '\0';
+	return (n);
+}
+
+/*
+ * A patch is applied atomically: if any operation fails, every earlier one
+ * is rolled back, and the document serializes exactly as it did before.
+ */
+static int
+test_patch()
+{
+	int f = 0;
+	char *in = "{\"a\": {\"b\": [0, 1, 2]}, \"c\": \"x\"}";
+	char before[256];
+	char after[256];
+	jsp_ast_t *a = jsp_parse(S(in));
+	f += CHECK(a != NULL);
+	if (a == NULL) {
+		return (f);
+	}
+	(void) ser(a, before, sizeof (before));
+
+	char *bad[] = {
+		"[{\"op\": \"add\", \"path\": \"/a/d\", \"value\": 1},"
+		" {\"op\": \"remove\", \"path\": \"/nope\"}]",
+		"[{\"op\": \"replace\", \"path\": \"/c\", \"value\": [1]},"
+		" {\"op\": \"test\", \"path\": \"/c\", \"value\": \"x\"}]",
+		"[{\"op\": \"remove\", \"path\": \"/a/b/0\"},"
+		" {\"op\": \"move\", \"from\": \"/a\", \"path\": \"/a/b\"}]",
+		"[{\"op\": \"copy\", \"from\": \"/a\", \"path\": \"/e\"},"
+		" {\"op\": \"bogus\", \"path\": \"/e\"}]",
+	};
+	size_t i;
+	for (i = 0; i < sizeof (bad) / sizeof (bad[0]); i++) {
+		f += CHECK(jsp_apply_patch(a, S(bad[i])) == -1);
+		(void) ser(a, after, sizeof (after));
+		f += CHECK(strcmp(before, after) == 0);
+	}
+
+	jsp_walk_t *w = jsp_create_walker();
+	f += CHECK(jsp_walk_member(a, w, S("a")) == 0);
+	char *good = "[{\"op\": \"add\", \"path\": \"/a/b/-\", \"value\": 3},"
+	    " {\"op\": \"test\", \"path\": \"/a/b\","
+	    " \"value\": [0, 1, 2, 3.0]},"
+	    " {\"op\": \"move\", \"from\": \"/c\", \"path\": \"/d\"},"
+	    " {\"op\": \"replace\", \"path\": \"/a\", \"value\": null}]";
+	f += CHECK(jsp_apply_patch(a, S(good)) == 0);
+	(void) ser(a, after, sizeof (after));
+	f += CHECK(strcmp(after, "{\"a\":null,\"d\":\"x\"}") == 0);
+
+	/* The walker was on the value that was replaced. */
+	f += CHECK(jsp_walk_member(a, w, S("b")) != 0);
+	jsp_walk_reset(w);
+	f += CHECK(jsp_walk_member(a, w, S("d")) == 0);
+	jsp_destroy_walker(w);
+	jsp_destroy(a);
+	return (f);
+}
+
+/*
+ * Appends, inserts, and deletes at both ends of long lists, and a patch that
+ * fails after growing a list, which must leave its tail where it was.
+ * Children that an edit didn't touch keep the whitespace between them.
+ */
+static int
+test_edits()
+{
+	int f = 0;
+	size_t cap = 1024 * 1024;
+	char *out = malloc(cap);
+	char *exp = malloc(cap);
+	size_t n = 20000;
+	size_t i;
+	size_t sz;
+	jsp_ast_t *a = jsp_parse(S("{\"l\": [0, 1], \"m\": 2}"));
+	jsp_walk_t *w = jsp_create_walker();
+	f += CHECK(a != NULL);
+	if (a == NULL) {
+		return (f);
+	}
+	f += CHECK(jsp_walk_member(a, w, S("l")) == 0);
+	for (i = 2; i < n; i++) {
+		sz = sprintf(out, "%zu", i);
+		f += CHECK(jsp_append_value(a, w, out, sz) == 0);
+	}
+	jsp_walk_reset(w);
+	for (i = 0; i < n; i++) {
+		sz = sprintf(out, "k%zu", i);
+		f += CHECK(jsp_insert_member(a, w, out, sz, S("0")) == 0);
+	}
+	for (i = 0; i < n; i += 2) {
+		sz = sprintf(out, "k%zu", i);
+		f += CHECK(jsp_delete_member(a, w, out, sz) == 0);
+	}
+	f += CHECK(jsp_apply_patch(a, S("[{\"op\": \"add\", \"path\": \"/l/0\","
+	    " \"value\": -1}, {\"op\": \"remove\", \"path\": \"/m\"}]")) == 0);
+	f += CHECK(jsp_apply_patch(a, S("[{\"op\": \"add\", \"path\": \"/l/-\","
+	    " \"value\": 9}, {\"op\": \"test\", \"path\": \"/l/0\","
+	    " \"value\": 0}]")) == -1);
+	f += CHECK(jsp_walk_member(a, w, S("l")) == 0);
+	f += CHECK(jsp_append_value(a, w, S("\"end\"")) == 0);
+
+	sz = sprintf(exp, "{\"l\":[-1,0, 1");
+	for (i = 2; i < n; i++) {
+		sz += sprintf(exp + sz, ",%zu", i);
+	}
+	sz += sprintf(exp + sz, ",\"end\"]");
+	for (i = 1; i < n; i += 2) {
+		sz += sprintf(exp + sz, ",\"k%zu\":0", i);
+	}
+	sz += sprintf(exp + sz, "}");
+	f += CHECK(ser(a, out, cap) == sz && strcmp(out, exp) == 0);
+	jsp_destroy_walker(w);
+	jsp_destroy(a);
+	free(out);
+	free(exp);
+	return (f);
+}
+
+/*
+ * Replaces `old` bytes at `off` in `in` with `rep`, in a new buffer.
+ */
+static char *
+splice(char *in, size_t sz, size_t off, size_t old, char *rep, size_t *nsz)
+{
+	size_t rsz = strlen(rep);
+	char *out = malloc(sz - old + rsz + 1);
+	if (out == NULL) {
+		return (NULL);
+	}
+	bcopy(in, out, off);
+	bcopy(rep, out + off, rsz);
+	bcopy(in + off + old, out + off + rsz, sz - off - old);
+	*nsz = sz - old + rsz;
+	out[*nsz] = '\0';
+	return (out);
+}
+
+/*
+ * Makes a series of random edits to a document, re-parses after each one,
+ * and checks the result against a full parse of the edited input. Edits that
+ * break the document must fail, and leave it as it was.
+ */
+static int
+test_reparse()
+{
+	int f = 0;
+	size_t sz = 0;
+	size_t cap = 64 * 1024;
+	char *in = malloc(cap);
+	int i;
+	sz += sprintf(in, "{\"list\": [");
+	for (i = 0; i < 200; i++) {
+		sz += sprintf(in + sz, "%s{\"id\": %d, \"tags\":"
+		    " [\"a\", \"b\"], \"v\": {\"x\": %d.5, \"y\": \"str\"}}",
+		    i ? ", " : "", i, i * 7);
+	}
+	sz += sprintf(in + sz, "], \"n\": 1}");
+	jsp_ast_t *a = jsp_parse(in, sz);
+	f += CHECK(a != NULL);
+	if (a == NULL) {
+		free(in);
+		return (f);
+	}
+
+	char *reps[] = { "7", "-12.5e3", "[1, {\"q\": 2}]", "\"s t r\"",
+	    "{}", "null" };
+	char *breaks[] = { "}", "[", ",", "\"" };
+	char *b1 = malloc(cap * 2);
+	char *b2 = malloc(cap * 2);
+	srand(1);
+	for (i = 0; i < 300; i++) {
+		/* Find a digit, and the rest of the number it's in. */
+		size_t off = rand() % sz;
+		while (off < sz && (in[off] < '0' || in[off] > '9')) {
+			off++;
+		}
+		if (off == sz) {
+			continue;
+		}
+		while (in[off - 1] == '-' || in[off - 1] == '.' ||
+		    (in[off - 1] >= '0' && in[off - 1] <= '9')) {
+			off--;
+		}
+		size_t old = 0;
+		while (strchr("-.e0123456789", in[off + old]) != NULL) {
+			old++;
+		}
+		int brk = i % 10 == 9;
+		char *rep = brk ? breaks[rand() % 4] : reps[rand() % 6];
+		size_t nsz;
+		char *n = splice(in, sz, off, old, rep, &nsz);
+		f += CHECK(n != NULL);
+		if (n == NULL) {
+			break;
+		}
+		size_t s1 = ser(a, b1, cap * 2);
+		int r = jsp_reparse(a, n, nsz, off, old, strlen(rep));
+		jsp_ast_t *full = jsp_parse(n, nsz);
+		f += CHECK((r == 0) == (full != NULL));
+		if (r != 0) {
+			size_t s2 = ser(a, b2, cap * 2);
+			f += CHECK(s1 == s2 && bcmp(b1, b2, s1) == 0);
+			free(n);
+			continue;
+		}
+		s1 = ser(a, b1, cap * 2);
+		size_t s2 = ser(full, b2, cap * 2);
+		f += CHECK(s1 == s2 && bcmp(b1, b2, s1) == 0);
+		jsp_walk_t *w1 = jsp_create_walker();
+		jsp_walk_t *w2 = jsp_create_walker();
+		f += CHECK(jsp_value_equal(a, w1, full, w2) == 1);
+		f += CHECK(jsp_value_hash(a, w1) == jsp_value_hash(full, w2));
+		jsp_destroy_walker(w2);
+		f += CHECK(jsp_walk_member(a, w1, S("n")) == 0);
+		jsp_destroy_walker(w1);
+		jsp_destroy(full);
+		free(in);
+		in = n;
+		sz = nsz;
+		if (f != 0) {
+			break;
+		}
+	}
+	free(b1);
+	free(b2);
+	jsp_destroy(a);
+	free(in);
+	return (f);
+}
+
+/*
+ * A document nested right up to the depth limit. Nothing may be added, by
+ * an edit, a patch, or a re-parse, that nests a container any deeper, but the
+ * same values can go anywhere shallower.
+ */
+static int
+test_depth()
+{
+	int f = 0;
+	size_t n = 1023;
+	size_t cap = 16 * n;
+	char *in = malloc(cap);
+	char *path = malloc(cap);
+	char *out = malloc(cap);
+	char *exp = malloc(cap);
+	size_t sz = 0;
+	size_t psz = 0;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		sz += sprintf(in + sz, "{\"a\":");
+		psz += sprintf(path + psz, "/a");
+	}
+	sz += sprintf(in + sz, "[]");
+	for (i = 0; i < n; i++) {
+		in[sz++] = '}';
+	}
+	in[sz] = '\0';
+	jsp_ast_t *a = jsp_parse(in, sz);
+	f += CHECK(a != NULL);
+	if (a == NULL || path == NULL || out == NULL || exp == NULL) {
+		return (f + 1);
+	}
+
+	/* The innermost array is at 5 * n. */
+	size_t nsz;
+	char *deep = splice(in, sz, 5 * n, 2, "[[]]", &nsz);
+	f += CHECK(jsp_reparse(a, deep, nsz, 5 * n, 2, 4) != 0);
+	f += CHECK(ser(a, out, cap) == sz && strcmp(out, in) == 0);
+	free(deep);
+
+	jsp_walk_t *w = jsp_create_walker();
+	for (i = 0; i < n; i++) {
+		f += CHECK(jsp_walk_member(a, w, S("a")) == 0);
+	}
+	f += CHECK(jsp_append_value(a, w, S("[]")) != 0);
+	f += CHECK(jsp_append_value(a, w, S("1")) == 0);
+	(void) sprintf(exp, "[{\"op\": \"add\", \"path\": \"%s/-\","
+	    " \"value\": [1]}]", path);
+	f += CHECK(jsp_apply_patch(a, S(exp)) != 0);
+	(void) sprintf(exp, "[{\"op\": \"add\", \"path\": \"%s/-\","
+	    " \"value\": 3}]", path);
+	f += CHECK(jsp_apply_patch(a, S(exp)) == 0);
+	f += CHECK(jsp_apply_patch(a, S("[{\"op\": \"add\", \"path\": \"/b\","
+	    " \"value\": [[1]]}]")) == 0);
+	f += CHECK(jsp_set_value(a, w, S("[[2]]")) != 0);
+	f += CHECK(jsp_set_value(a, w, S("[2]")) == 0);
+
+	sz = 0;
+	for (i = 0; i < n; i++) {
+		sz += sprintf(exp + sz, "{\"a\":");
+	}
+	sz += sprintf(exp + sz, "[2]");
+	for (i = 1; i < n; i++) {
+		exp[sz++] = '}';
+	}
+	sz += sprintf(exp + sz, ",\"b\":[[1]]}");
+	f += CHECK(ser(a, out, cap) == sz && strcmp(out, exp) == 0);
+	jsp_destroy_walker(w);
+	jsp_destroy(a);
+	free(in);
+	free(path);
+	free(out);
+	free(exp);
+	return (f);
+}
+
+/*
+ * A parse that doesn't fit in its budget fails with ENOMEM, and so does an
+ * edit that would take the document over it, leaving it as it was.
+ * Keys interned into a dictionary are charged too.
+ */
+static int
+test_budget()
+{
+	int f = 0;
+	size_t cap = 256 * 1024;
+	char *in = malloc(cap);
+	size_t sz = 0;
+	int i;
+	sz += sprintf(in, "[");
+	for (i = 0; i < 5000; i++) {
+		sz += sprintf(in + sz, "%s{\"k%d\": %d}", i ? "," : "", i, i);
+	}
+	sz += sprintf(in + sz, "]");
+
+	errno = 0;
+	f += CHECK(jsp_parse_budget(in, sz, NULL, 4096) == NULL);
+	f += CHECK(errno == ENOMEM);
+	errno = 0;
+	f += CHECK(jsp_parse_budget(S("[1, 2"), NULL, 0) == NULL);
+	f += CHECK(errno == EINVAL);
+
+	jsp_keydict_t *d = jsp_keydict_create();
+	jsp_ast_t *a = jsp_parse_budget(in, sz, d, 0);
+	f += CHECK(a != NULL);
+	size_t keys = jsp_keydict_count(d);
+	if (a != NULL) {
+		jsp_destroy(a);
+	}
+
+	/*
+	 * Find the smallest budget that the document fits in without its
+	 * keys.
+	 */
+	size_t lo = 4096;
+	size_t hi = 64 * 1024 * 1024;
+	while (lo + 1 < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		a = jsp_parse_budget(in, sz, NULL, mid);
+		if (a != NULL) {
+			jsp_destroy(a);
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+
+	/* It doesn't fit once the keys are charged... */
+	jsp_keydict_t *d2 = jsp_keydict_create();
+	errno = 0;
+	f += CHECK(jsp_parse_budget(in, sz, d2, hi) == NULL);
+	f += CHECK(errno == ENOMEM);
+	jsp_keydict_destroy(d2);
+
+	/* ...unless they are already in the dictionary. */
+	a = jsp_parse_budget(in, sz, d, hi);
+	f += CHECK(a != NULL);
+	f += CHECK(jsp_keydict_count(d) == keys);
+	if (a != NULL) {
+		char *b1 = malloc(cap);
+		char *b2 = malloc(cap);
+		size_t s1 = ser(a, b1, cap);
+		jsp_walk_t *w = jsp_create_walker();
+		int r = 0;
+		for (i = 0; i < 100000 && r == 0; i++) {
+			s1 = ser(a, b1, cap);
+			errno = 0;
+			r = jsp_append_value(a, w, S("[1, 2, 3]"));
+		}
+		f += CHECK(r == -1 && errno == ENOMEM);
+		size_t s2 = ser(a, b2, cap);
+		f += CHECK(s1 == s2 && bcmp(b1, b2, s1) == 0);
+		jsp_destroy_walker(w);
+		jsp_destroy(a);
+		free(b1);
+		free(b2);
+	}
+	jsp_keydict_destroy(d);
+	free(in);
+	return (f);
+}
+
+/*
+ * Both backends read a file several read chunks long into the document that
+ * parsing its contents gives, and fail on a file that isn't well-formed, or
+ * isn't there. A file that goes wrong in its first chunk fails while later
+ * chunks are still being read.
+ */
+static int
+test_file()
+{
+	int f = 0;
+	size_t cap = 4 * 1024 * 1024;
+	char *in = malloc(cap);
+	char *out = malloc(cap);
+	size_t sz = 0;
+	int i;
+	sz += sprintf(in, "[");
+	for (i = 0; sz < 3 * 1024 * 1024; i++) {
+		sz += sprintf(in + sz, "%s{\"id\": %d, \"s\": \"%0*d\"}",
+		    i ? ",\n" : "", i, i % 50, i);
+	}
+	sz += sprintf(in + sz, "]\n");
+
+	char path[] = "/tmp/jsp_test.XXXXXX";
+	int fd = mkstemp(path);
+	f += CHECK(fd >= 0 && write(fd, in, sz) == (ssize_t)sz);
+	int flags[] = { 0, JSP_FILE_URING };
+	size_t j;
+	for (j = 0; j < 2; j++) {
+		jsp_ast_t *a = jsp_parse_file(path, flags[j]);
+		f += CHECK(a != NULL);
+		if (a == NULL) {
+			continue;
+		}
+		f += CHECK(ser(a, out, cap) == sz - 1 &&
+		    bcmp(in, out, sz - 1) == 0);
+		jsp_destroy(a);
+	}
+	f += CHECK(pwrite(fd, "}", 1, 1) == 1);
+	for (j = 0; j < 2; j++) {
+		errno = 0;
+		f += CHECK(jsp_parse_file(path, flags[j]) == NULL &&
+		    errno == EINVAL);
+	}
+	f += CHECK(pwrite(fd, in + 1, 1, 1) == 1);
+	f += CHECK(ftruncate(fd, sz - 3) == 0);
+	for (j = 0; j < 2; j++) {
+		errno = 0;
+		f += CHECK(jsp_parse_file(path, flags[j]) == NULL &&
+		    errno == EINVAL);
+	}
+	(void) close(fd);
+	(void) unlink(path);
+	for (j = 0; j < 2; j++) {
+		errno = 0;
+		f += CHECK(jsp_parse_file(path, flags[j]) == NULL &&
+		    errno == ENOENT);
+	}
+	free(in);
+	free(out);
+	return (f);
+}
+
+/*
+ * The documents in a batch share an arena until one of them needs to grow.
+ * Edit some of them (so that they detach), destroy the rest in between, and
+ * make sure that every one of them still holds what it should.
+ */
+static int
+test_batch()
+{
+	int f = 0;
+	size_t n = 300;
+	size_t i;
+	char **bufs = calloc(n, sizeof (char *));
+	size_t *lens = calloc(n, sizeof (size_t));
+	jsp_ast_t **out = calloc(n, sizeof (jsp_ast_t *));
+	char exp[512];
+	char got[512];
+	size_t nexp = 0;
+	for (i = 0; i < n; i++) {
+		bufs[i] = malloc(128);
+		if (i % 9 == 4) {
+			(void) sprintf(bufs[i], "{\"i\": %zu,", i);
+		} else {
+			nexp++;
+			(void) sprintf(bufs[i], "{\"i\": %zu, \"l\": [1, 2]}",
+			    i);
+		}
+		lens[i] = strlen(bufs[i]);
+	}
+	f += CHECK(jsp_parse_batch(bufs, lens, n, out) == nexp);
+
+	jsp_walk_t *w = jsp_create_walker();
+	for (i = 0; i < n; i++) {
+		f += CHECK((out[i] == NULL) == (i % 9 == 4));
+		if (out[i] == NULL || i % 3 != 0) {
+			continue;
+		}
+		jsp_walk_reset(w);
+		f += CHECK(jsp_insert_member(out[i], w, S("big"),
+		    S("[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15]")) ==
+		    0);
+		f += CHECK(jsp_walk_member(out[i], w, S("l")) == 0);
+		f += CHECK(jsp_append_value(out[i], w,
+		    S("{\"z\": true}")) == 0);
+		if (i % 2 == 1 && out[i - 1] != NULL) {
+			jsp_destroy(out[i - 1]);
+			out[i - 1] = NULL;
+		}
+	}
+	jsp_destroy_walker(w);
+	for (i = 0; i < n; i++) {
+		if (out[i] == NULL) {
+			continue;
+		}
+		if (i % 3 == 0) {
+			(void) sprintf(exp, "{\"i\": %zu,\"l\":[1, 2,"
+			    "{\"z\": true}],\"big\":[1, 2, 3, 4, 5, 6, 7, 8,"
+			    " 9, 10, 11, 12, 13, 14, 15]}", i);
+		} else {
+			(void) strcpy(exp, bufs[i]);
+		}
+		(void) ser(out[i], got, sizeof (got));
+		f += CHECK(strcmp(got, exp) == 0);
+		jsp_destroy(out[i]);
+	}
+	for (i = 0; i < n; i++) {
+		free(bufs[i]);
+	}
+	free(bufs);
+	free(lens);
+	free(out);
+	return (f);
+}
+
+/*
+ * jsp_validate() reports where the input first goes wrong. Every prefix of a
+ * document several blocks long, and the document with each byte changed,
+ * validates exactly when it parses, whichever of the two passes decides.
+ */
+static int
+test_validate()
+{
+	struct {
+		char		*in;
+		jsp_errclass_t	class;
+		size_t		off;
+		size_t		line;
+		size_t		col;
+	} cases[] = {
+		{ "{\"a\": [1, 2, {\"b\": null}]}", JSP_ERR_NONE, 0, 0, 0 },
+		{ "{\"a\": [1, 2,\n {\"b\": nul}]}", JSP_ERR_SYNTAX, 23, 2,
+		    11 },
+		{ "{\"a\": [1, 2,\n {\"b\": null}]", JSP_ERR_EOF, 26, 2, 14 },
+		{ "{\"a\": 01}", JSP_ERR_NUMBER, 6, 1, 7 },
+		{ "[1, -012]", JSP_ERR_NUMBER, 5, 1, 6 },
+		{ "{\"a\": -}", JSP_ERR_NUMBER, 7, 1, 8 },
+		{ "[1.e5]", JSP_ERR_NUMBER, 3, 1, 4 },
+		{ "[\"abc\\q\"]", JSP_ERR_STRING, 5, 1, 6 },
+		{ "[\"\\u12g4\"]", JSP_ERR_STRING, 2, 1, 3 },
+		{ "[\"h\xc3\x28llo\"]", JSP_ERR_UTF8, 3, 1, 4 },
+		{ "[1] x", JSP_ERR_TRAILING, 4, 1, 5 },
+		{ "{\"a\" 1}", JSP_ERR_SYNTAX, 5, 1, 6 },
+		{ "{1:2}", JSP_ERR_SYNTAX, 1, 1, 2 },
+	};
+	int f = 0;
+	size_t i;
+	for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+		jsp_err_t e;
+		int r = jsp_validate(S(cases[i].in), &e);
+		f += CHECK((r == 0) == (cases[i].class == JSP_ERR_NONE));
+		if (r == 0) {
+			continue;
+		}
+		if (CHECK(e.jspe_class == cases[i].class &&
+		    e.jspe_off == cases[i].off &&
+		    e.jspe_line == cases[i].line &&
+		    e.jspe_col == cases[i].col)) {
+			fprintf(stderr, "\t%s: class %d, offset %zu, %zu:%zu\n",
+			    cases[i].in, e.jspe_class, e.jspe_off, e.jspe_line,
+			    e.jspe_col);
+			f++;
+		}
+	}
+
+	char deep[2100];
+	memset(deep, '[', sizeof (deep));
+	jsp_err_t e;
+	f += CHECK(jsp_validate(deep, sizeof (deep), &e) != 0 &&
+	    e.jspe_class == JSP_ERR_DEPTH);
+
+	char doc[] = " {\"id\": -12.5e+3, \"ok\": [true, false, null, 0],"
+	    " \"s\": \"tab\\t \\\"q\\\" \\\\ \\u00e9 caf\xc3\xa9 \xe6\x97\xa5"
+	    " \xf0\x9f\x98\x80\", \"\": {\"k\\\\\": [[{}], \"\\/\"]},\n"
+	    " \"n\": [1, 22, 333, 0.25, 1E9]} ";
+	size_t sz = sizeof (doc) - 1;
+	f += CHECK(jsp_validate(doc, sz, NULL) == 0);
+	char *mut = malloc(sz);
+	char subs[] = "\"\\ ,:]}x0\x01\x80";
+	for (i = 0; i <= sz; i++) {
+		jsp_ast_t *a = jsp_parse(doc, i);
+		f += CHECK((jsp_validate(doc, i, NULL) == 0) == (a != NULL));
+		if (a != NULL) {
+			jsp_destroy(a);
+		}
+		size_t j;
+		for (j = 0; i < sz && j < sizeof (subs) - 1; j++) {
+			bcopy(doc, mut, sz);
+			mut[i] = subs[j];
+			a = jsp_parse(mut, sz);
+			f += CHECK((jsp_validate(mut, sz, NULL) == 0) ==
+			    (a != NULL));
+			if (a != NULL) {
+				jsp_destroy(a);
+			}
+		}
+	}
+	free(mut);
+	return (f);
+}
+
+/*
+ * Minifying in place, and not, with strings that hold whitespace, escaped
+ * quotes, and runs of backslashes, across block boundaries.
+ */
+static int
+test_minify()
+{
+	char *cases[][2] = {
+		{ " [ 1 , 2 ,\t\"a  b\" ]\n", "[1,2,\"a  b\"]" },
+		{ "{ \"x \\\" y\" : \"\\\\\" , \"z\" : \" \\\\\\\" \" }",
+		    "{\"x \\\" y\":\"\\\\\",\"z\":\" \\\\\\\" \"}" },
+		{ "[\"                                                     "
+		    "    \\\\\\\\\\\"      \", \r\n  \"                      "
+		    "                                                 \" ]",
+		    "[\"                                                     "
+		    "    \\\\\\\\\\\"      \",\"                      "
+		    "                                                 \"]" },
+	};
+	int f = 0;
+	size_t i;
+	char out[1024];
+	char buf[1024];
+	for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+		size_t n = jsp_minify(S(cases[i][0]), out);
+		f += CHECK(n == strlen(cases[i][1]) &&
+		    bcmp(out, cases[i][1], n) == 0);
+		(void) strcpy(buf, cases[i][0]);
+		n = jsp_minify(S(buf), buf);
+		f += CHECK(n == strlen(cases[i][1]) &&
+		    bcmp(buf, cases[i][1], n) == 0);
+	}
+
+	/*
+	 * A bigger document minifies to one with the same canonical form,
+	 * and no whitespace outside of strings.
+	 */
+	size_t sz = 0;
+	char *in = malloc(64 * 1024);
+	sz += sprintf(in, "[\n");
+	for (i = 0; i < 500; i++) {
+		sz += sprintf(in + sz, "%s  { \"s\" : \"%*s\\\"\\\\\" ,"
+		    "\t\"n\" : [ %zu , { } ] }", i ? ",\n" : "", (int)(i % 70),
+		    "", i);
+	}
+	sz += sprintf(in + sz, "\n]\n");
+	char *min = strdup(in);
+	size_t n = jsp_minify(min, sz, min);
+	min[n] = '\0';
+	f += CHECK(strchr(min, '\n') == NULL && strchr(min, '\t') == NULL);
+	jsp_ast_t *a = jsp_parse(in, sz);
+	jsp_ast_t *b = jsp_parse(min, n);
+	f += CHECK(a != NULL && b != NULL);
+	if (a != NULL && b != NULL) {
+		char *c1 = malloc(64 * 1024);
+		char *c2 = malloc(64 * 1024);
+		size_t s1 = jsp_canonicalize(a, c1, 64 * 1024);
+		size_t s2 = jsp_canonicalize(b, c2, 64 * 1024);
+		f += CHECK(s1 == s2 && bcmp(c1, c2, s1) == 0);
+		free(c1);
+		free(c2);
+	}
+	if (a != NULL) {
+		jsp_destroy(a);
+	}
+	if (b != NULL) {
+		jsp_destroy(b);
+	}
+	free(min);
+	free(in);
+	return (f);
+}
+
+/*
+ * Canonical numbers, and sorted keys.
+ */
+static int
+test_canon()
+{
+	char *cases[][2] = {
+		{ "[1.0, 1e0, 10e-1, -0, 0.000001, 1e-7, 1e21]",
+		    "[1,1,1,0,0.000001,1e-7,1e+21]" },
+		{ "[123456789012345678901, 1.5e300, 0.1, 100, 1E2, -2.50]",
+		    "[123456789012345680000,1.5e+300,0.1,100,100,-2.5]" },
+		{ "[-1.25e-10, 5e-324, 1e400, 0.30000000000000004]",
+		    "[-1.25e-10,5e-324,1e400,0.30000000000000004]" },
+		{ "{\"b\": 1, \"a\": [1.0], \"\": {\"z\": 0, \"y\": 1}}",
+		    "{\"\":{\"y\":1,\"z\":0},\"a\":[1],\"b\":1}" },
+	};
+	int f = 0;
+	size_t i;
+	char out[256];
+	for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+		jsp_ast_t *a = jsp_parse(S(cases[i][0]));
+		f += CHECK(a != NULL);
+		if (a == NULL) {
+			continue;
+		}
+		size_t n = jsp_canonicalize(a, out, sizeof (out));
+		if (CHECK(n == strlen(cases[i][1]) &&
+		    bcmp(out, cases[i][1], n) == 0)) {
+			fprintf(stderr, "\t%.*s\n", (int)n, out);
+			f++;
+		}
+		jsp_destroy(a);
+	}
+	return (f);
+}
+
+/*
+ * Equality ignores member order, but pairs up members with the same key in
+ * order, and compares numbers by value.
+ */
+static int
+test_equal()
+{
+	char *cases[][2] = {
+		{ "{\"a\": 1, \"b\": [1, 2]}", "{\"b\": [1, 2.0], \"a\": 1}" },
+		{ "{\"a\": 1, \"b\": 0, \"a\": 2}",
+		    "{\"b\": 0, \"a\": 1, \"a\": 2}" },
+		{ "{\"a\": 1, \"a\": 2}", "{\"a\": 2, \"a\": 1}" },
+		{ "{\"a\": 1, \"a\": 2}", "{\"a\": 1, \"a\": 1}" },
+		{ "{\"a\": 1}", "{\"a\": 1, \"b\": 1}" },
+		{ "[1, 2]", "[2, 1]" },
+	};
+	int eq[] = { 1, 1, 0, 0, 0, 0 };
+	int f = 0;
+	size_t i;
+	jsp_walk_t *w1 = jsp_create_walker();
+	jsp_walk_t *w2 = jsp_create_walker();
+	for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+		jsp_ast_t *a = jsp_parse(S(cases[i][0]));
+		jsp_ast_t *b = jsp_parse(S(cases[i][1]));
+		f += CHECK(a != NULL && b != NULL);
+		if (a == NULL || b == NULL) {
+			continue;
+		}
+		f += CHECK(jsp_value_equal(a, w1, b, w2) == eq[i]);
+		f += CHECK(jsp_value_equal(b, w2, a, w1) == eq[i]);
+		if (eq[i]) {
+			f += CHECK(jsp_value_hash(a, w1) ==
+			    jsp_value_hash(b, w2));
+		}
+		jsp_destroy(a);
+		jsp_destroy(b);
+	}
+	jsp_destroy_walker(w1);
+	jsp_destroy_walker(w2);
+	return (f);
+}
+
+static struct {
+	char	*name;
+	int	(*fn)();
+} tests[] = {
+	{ "keydict", test_keydict },
+	{ "value", test_value },
+	{ "patch", test_patch },
+	{ "edits", test_edits },
+	{ "reparse", test_reparse },
+	{ "depth", test_depth },
+	{ "budget", test_budget },
+	{ "file", test_file },
+	{ "batch", test_batch },
+	{ "validate", test_validate },
+	{ "minify", test_minify },
+	{ "canon", test_canon },
+	{ "equal", test_equal },
+};
+
+int
+main(int ac, char **av)
+{
+	int failed = 0;
+	size_t i;
+	for (i = 0; i < sizeof (tests) / sizeof (tests[0]); i++) {
+		int j;
+		for (j = 1; j < ac; j++) {
+			if (strcmp(av[j], tests[i].name) == 0) {
+				break;
+			}
+		}
+		if (ac > 1 && j == ac) {
+			continue;
+		}
+		int f = tests[i].fn();
+		printf("%-10s %s\n", tests[i].name, f == 0 ? "ok" : "FAILED");
+		failed += f != 0;
+	}
+	return (failed != 0);
+}